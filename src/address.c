@@ -9,6 +9,11 @@
 #include <string.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <ifaddrs.h>
 
 /*-----------------------------------------------------------------------------
  * IP Address / port type
@@ -31,10 +36,15 @@ int address_cmp(const address_t *l, const address_t *r) {
 }
 
 /* Validate address format:
- * address | address:port */
+ * address | address:port | unix:/path */
 int address_parse(address_t *addr, const char *address_spec, int default_port) {
     char* pos;
     
+    if(!strncmp(address_spec, ADDRESS_UNIX_PREFIX, /* strlen("unix:") */5)) {
+        if(address_spec[5] == 0) return ADDRESS_BAD_FORMAT;
+        return address_init(addr, address_spec + 5, 0);
+    }
+    
     pos = strchr(address_spec, ':');
     if(pos) {
         int port;
@@ -60,6 +70,41 @@ int address_parse(address_t *addr, const char *address_spec, int default_port) {
     }
 }
 
+int address_unix_p(const address_t *addr) {
+    return addr->port == 0;
+}
+
+int address_local_p(const address_t *addr) {
+    struct ifaddrs *ifaddr;
+    struct ifaddrs *ifa;
+    char host[INET6_ADDRSTRLEN];
+    const void *sin_addr;
+    int local;
+    
+    if(address_unix_p(addr)) return 1;
+    if(!strcmp(addr->host, "localhost") || !strncmp(addr->host, "127.", 4) || !strcmp(addr->host, "::1"))
+        return 1;
+    
+    if(getifaddrs(&ifaddr)) return 0;
+    
+    local = 0;
+    for(ifa = ifaddr; ifa && !local; ifa = ifa->ifa_next) {
+        if(!ifa->ifa_addr) continue;
+        
+        if(ifa->ifa_addr->sa_family == AF_INET)
+            sin_addr = &((struct sockaddr_in*)ifa->ifa_addr)->sin_addr;
+        else if(ifa->ifa_addr->sa_family == AF_INET6)
+            sin_addr = &((struct sockaddr_in6*)ifa->ifa_addr)->sin6_addr;
+        else
+            continue;
+        
+        if(inet_ntop(ifa->ifa_addr->sa_family, sin_addr, host, sizeof(host)))
+            local = !strcmp(addr->host, host);
+    }
+    freeifaddrs(ifaddr);
+    return local;
+}
+
 void address_free(address_t *address) {
     (void)address;
     /*noop*/
@@ -12,13 +12,15 @@
  * IP Address / port type
  *----------------------------------------------------------------------------*/
 
-#define ADDRESS_MAX_HOST_LEN 256     /* IPv4 15; IPv6 45; DNS 253 */
+#define ADDRESS_MAX_HOST_LEN 256     /* IPv4 15; IPv6 45; DNS 253; unix socket path 107 */
+#define ADDRESS_UNIX_PREFIX "unix:"
 
 enum {
     ADDRESS_OK = 0,
     ADDRESS_BAD_FORMAT
 };
 
+/* A unix domain socket has the path as host and port 0 */
 typedef struct address_t {
     char host[ADDRESS_MAX_HOST_LEN];
     int port;
@@ -27,6 +29,9 @@ typedef struct address_t {
 int  address_init(address_t *addr, const char *host, int port);
 int  address_cmp(const address_t *l, const address_t *r);
 int  address_parse(address_t *addr, const char *address_spec, int default_port);
+int  address_unix_p(const address_t *addr);
+/* nonzero if host is an address of this machine */
+int  address_local_p(const address_t *addr);
 void address_free(address_t *address);
 
 #endif /* ADDRESS_H_ */
@@ -15,6 +15,32 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+#include <poll.h>
+
+static struct timeval ms_timeval(long ms) {
+    struct timeval tv;
+    tv.tv_sec = ms / 1000;
+    tv.tv_usec = (ms % 1000) * 1000;
+    return tv;
+}
+
+static long long monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void sleep_ms(long ms) {
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000;
+    nanosleep(&ts, 0);
+}
+
+static void redis_vtbl_replica_free(redis_vtbl_replica *replica);
 
 static const char* trim_ws(const char *str) {
     while(*str && isspace(*str))
@@ -23,7 +49,9 @@ static const char* trim_ws(const char *str) {
 }
 
 int redis_vtbl_command_init(redis_vtbl_command *cmd) {
-    list_init(&cmd->args, free);
+    list_init(&cmd->args, 0);
+    vector_init(&cmd->lens, sizeof(size_t), 0);
+    list_init(&cmd->owned, free);
     return CONNECTION_OK;
 }
 int redis_vtbl_command_init_arg(redis_vtbl_command *cmd, const char *arg) {
@@ -39,14 +67,29 @@ int redis_vtbl_command_init_arg(redis_vtbl_command *cmd, const char *arg) {
     }
     return CONNECTION_OK;
 }
+/* take ownership of the allocated argument str */
+static int redis_vtbl_command_arg_owned(redis_vtbl_command *cmd, char *str, size_t len) {
+    if(list_push(&cmd->owned, str)) {
+        free(str);
+        return CONNECTION_ENOMEM;
+    }
+    return redis_vtbl_command_arg_ref(cmd, str, len);
+}
 int redis_vtbl_command_arg(redis_vtbl_command *cmd, const char *arg) {
-    int err;
+    return redis_vtbl_command_arg_len(cmd, arg, strlen(arg));
+}
+int redis_vtbl_command_arg_len(redis_vtbl_command *cmd, const void *arg, size_t len) {
     char *str;
-    str = strdup(arg);
+    str = malloc(len + 1);
     if(!str) return CONNECTION_ENOMEM;
-    err = list_push(&cmd->args, str);
-    if(err) {
-        free(str);
+    memcpy(str, arg, len);
+    str[len] = 0;
+    return redis_vtbl_command_arg_owned(cmd, str, len);
+}
+int redis_vtbl_command_arg_ref(redis_vtbl_command *cmd, const void *arg, size_t len) {
+    if(list_push(&cmd->args, (void*)arg)) return CONNECTION_ENOMEM;
+    if(vector_push(&cmd->lens, &len)) {
+        --cmd->args.size;
         return CONNECTION_ENOMEM;
     }
     return CONNECTION_OK;
@@ -88,24 +131,66 @@ int redis_vtbl_command_arg_fmt(redis_vtbl_command *cmd, const char *arg, ...) {
         }
     }
     
-    err = list_push(&cmd->args, str);
-    if(err) {
-        free(str);
-        return CONNECTION_ENOMEM;
+    return redis_vtbl_command_arg_owned(cmd, str, err);
+}
+void redis_vtbl_command_free(redis_vtbl_command *cmd) {
+    list_free(&cmd->args);
+    vector_free(&cmd->lens);
+    list_free(&cmd->owned);
+}
+
+int redis_vtbl_command_args(redis_vtbl_command *cmd, const redis_vtbl_command *src) {
+    int err;
+    size_t i;
+    
+    for(i = 0; i < src->args.size; ++i) {
+        err = redis_vtbl_command_arg_len(cmd, src->args.data[i], ((size_t*)src->lens.data)[i]);
+        if(err) return err;
+    }
+    return CONNECTION_OK;
+}
+
+/* append references to the arguments of src; src must outlive cmd */
+static int redis_vtbl_command_refs(redis_vtbl_command *cmd, const redis_vtbl_command *src) {
+    int err;
+    size_t i;
+    
+    for(i = 0; i < src->args.size; ++i) {
+        err = redis_vtbl_command_arg_ref(cmd, src->args.data[i], ((size_t*)src->lens.data)[i]);
+        if(err) return err;
     }
+    return CONNECTION_OK;
+}
+
+int redis_vtbl_command_copy(redis_vtbl_command *cmd, const redis_vtbl_command *src) {
+    int err;
+    
+    err = redis_vtbl_command_init(cmd);
+    if(err) return err;
     
+    err = redis_vtbl_command_args(cmd, src);
+    if(err) {
+        redis_vtbl_command_free(cmd);
+        return err;
+    }
     return CONNECTION_OK;
 }
-void redis_vtbl_command_free(redis_vtbl_command *cmd) {
-    list_free(&cmd->args);
+
+typedef struct redis_vtbl_script {
+    const char *source;
+    char sha[41];
+} redis_vtbl_script;
+
+static int redis_vtbl_script_source_cmp(const char *source, const redis_vtbl_script *script) {
+    return source != script->source;
 }
 
 /* Initialise a new connection object from the given configuration.
  *
- * address[:port]
+ * address[:port] | unix:/path
  * A connection to a single redis instance
  *
- * sentinel service-name address[:port][ address[:port]...]
+ * sentinel service-name address[:port][ address[:port]...][ unix:/path]
  * A connection to the redis sentinel service at the given addresses. */
 int redis_vtbl_connection_init(redis_vtbl_connection *conn, const char *config) {
     
@@ -114,11 +199,15 @@ int redis_vtbl_connection_init(redis_vtbl_connection *conn, const char *config)
     if(!*config) return CONNECTION_BAD_FORMAT;
     
     conn->service = 0;
+    conn->local_socket = 0;
+    conn->quorum = 1;
+    conn->master.host[0] = 0;
+    conn->master.port = 0;
     conn->errstr[0] = 0;
     conn->c = 0;
     
     /* Validate format:
-     * sentinel service-name address[:port][; address[:port]...] */
+     * sentinel service-name [quorum=n] address[:port][; address[:port]...] */
     if(!strncmp(config, "sentinel ", /* strlen("sentinel ") */9)) {
         int err;
         size_t i;
@@ -142,11 +231,37 @@ int redis_vtbl_connection_init(redis_vtbl_connection *conn, const char *config)
 
         for(i = 2; i < tok_list.size; ++i) {
             address_t address;
+            const char *tok;
+            
+            tok = list_get(&tok_list, i);
+            if(!strncmp(tok, "quorum=", 7)) {
+                char *end;
+                long quorum;
+                
+                quorum = strtol(tok + 7, &end, 10);
+                if(*end || end == tok + 7 || quorum < 1 || quorum > 255) {
+                    list_free(&tok_list);
+                    free(conn->service);
+                    free(conn->local_socket);
+                    vector_free(&conn->addresses);
+                    return CONNECTION_BAD_FORMAT;
+                }
+                conn->quorum = (int)quorum;
+                continue;
+            }
             
-            err = address_parse(&address, list_get(&tok_list, i), DEFAULT_SENTINEL_PORT);
+            err = address_parse(&address, tok, DEFAULT_SENTINEL_PORT);
+            if(!err && address_unix_p(&address)) {
+                /* socket of a local master rather than a sentinel; at most one */
+                if(conn->local_socket || !(conn->local_socket = strdup(address.host)))
+                    err = 1;
+                address_free(&address);
+                if(!err) continue;
+            }
             if(err) {
                 list_free(&tok_list);
                 free(conn->service);
+                free(conn->local_socket);
                 vector_free(&conn->addresses);
                 return CONNECTION_BAD_FORMAT;
             }
@@ -155,12 +270,20 @@ int redis_vtbl_connection_init(redis_vtbl_connection *conn, const char *config)
                 address_free(&address);
                 vector_free(&conn->addresses);
                 free(conn->service);
+                free(conn->local_socket);
                 list_free(&tok_list);
                 return CONNECTION_ENOMEM;
             }
         }
         list_free(&tok_list);
         
+        if(conn->addresses.size == 0) {
+            vector_free(&conn->addresses);
+            free(conn->service);
+            free(conn->local_socket);
+            return CONNECTION_BAD_FORMAT;
+        }
+        
     } else {
         int err;
         address_t address;
@@ -178,10 +301,78 @@ int redis_vtbl_connection_init(redis_vtbl_connection *conn, const char *config)
     }
     
     vector_init(&conn->cmd_queue, sizeof(redis_vtbl_command), (void (*)(void *))redis_vtbl_command_free);
+    vector_init(&conn->scripts, sizeof(redis_vtbl_script), 0);
+    
+    conn->connect_timeout = CONNECTION_CONNECT_TIMEOUT;
+    conn->command_timeout = CONNECTION_COMMAND_TIMEOUT;
+    conn->retry_deadline = CONNECTION_RETRY_DEADLINE;
+    conn->down_until = 0;
+    conn->jitter = (unsigned int)time(0) ^ (unsigned int)(size_t)conn;
+    
+    vector_init(&conn->replicas, sizeof(redis_vtbl_replica), (void(*)(void*))redis_vtbl_replica_free);
+    conn->replica_next = 0;
+    conn->master_offset = 0;
+    conn->replica_checked = 0;
+    
+    conn->watch = 0;
+    conn->watch_retry = 0;
     
     return CONNECTION_OK;
 }
 
+/* SCRIPT LOAD each registered script in a single pipeline.
+ * Scripts that fail to load are loaded again on first use. */
+int redis_vtbl_connection_load_scripts(redis_vtbl_connection *conn) {
+    size_t i;
+    redis_vtbl_script *script;
+    redisReply *reply;
+    int err;
+    
+    if(!conn->c || conn->scripts.size == 0) return CONNECTION_OK;
+    
+    for(i = 0; i < conn->scripts.size; ++i) {
+        script = vector_get(&conn->scripts, i);
+        script->sha[0] = 0;
+        redisAppendCommand(conn->c, "SCRIPT LOAD %s", script->source);
+    }
+    
+    err = CONNECTION_OK;
+    for(i = 0; i < conn->scripts.size; ++i) {
+        script = vector_get(&conn->scripts, i);
+        if(redisGetReply(conn->c, (void**)&reply) != REDIS_OK) return CONNECTION_ERROR;
+        
+        if(reply->type == REDIS_REPLY_STRING && reply->len == 40) {
+            memcpy(script->sha, reply->str, 40);
+            script->sha[40] = 0;
+        } else {
+            err = CONNECTION_ERROR;
+        }
+        freeReplyObject(reply);
+    }
+    return err;
+}
+
+void redis_vtbl_connection_timeouts(redis_vtbl_connection *conn, long connect_ms, long command_ms, long retry_ms) {
+    if(connect_ms >= 0) conn->connect_timeout = connect_ms;
+    if(retry_ms >= 0) conn->retry_deadline = retry_ms;
+    if(command_ms >= 0) {
+        conn->command_timeout = command_ms;
+        if(conn->c) redisSetTimeout(conn->c, ms_timeval(command_ms));
+    }
+}
+
+/* Connect to the redis at address within the connect timeout */
+static redisContext* redis_vtbl_connection_open(redis_vtbl_connection *conn, const address_t *address) {
+    if(address_unix_p(address)) {
+        if(conn->connect_timeout)
+            return redisConnectUnixWithTimeout(address->host, ms_timeval(conn->connect_timeout));
+        return redisConnectUnix(address->host);
+    }
+    if(conn->connect_timeout)
+        return redisConnectWithTimeout(address->host, address->port, ms_timeval(conn->connect_timeout));
+    return redisConnect(address->host, address->port);
+}
+
 int redis_vtbl_connection_connect(redis_vtbl_connection *conn) {
     int err;
     
@@ -191,7 +382,8 @@ int redis_vtbl_connection_connect(redis_vtbl_connection *conn) {
     conn->c = 0;
     
     if(conn->service) {     /* sentinel */
-        err = redisSentinelConnect(&conn->addresses, conn->service, &conn->c);
+        err = redisSentinelConnect(&conn->addresses, conn->service, conn->local_socket, conn->connect_timeout,
+                conn->quorum, &conn->master, &conn->c);
         if(err) {
             switch(err) {
                 case SENTINEL_ERROR:
@@ -207,7 +399,10 @@ int redis_vtbl_connection_connect(redis_vtbl_connection *conn) {
                     strcpy(conn->errstr, "Unreachable");
                     break;
             }
+            return err;
         }
+        if(conn->command_timeout) redisSetTimeout(conn->c, ms_timeval(conn->command_timeout));
+        redis_vtbl_connection_load_scripts(conn);
         return err;
     
     } else {                /* redis */
@@ -217,9 +412,12 @@ int redis_vtbl_connection_connect(redis_vtbl_connection *conn) {
         if(!redis) return CONNECTION_ERROR;   /* logic error */
         
 #ifndef QUIET
-        fprintf(stderr, "redis_vtbl: Connecting to redis %s:%d... ", redis->host, redis->port);
+        if(address_unix_p(redis))
+            fprintf(stderr, "redis_vtbl: Connecting to redis unix:%s... ", redis->host);
+        else
+            fprintf(stderr, "redis_vtbl: Connecting to redis %s:%d... ", redis->host, redis->port);
 #endif
-        conn->c = redisConnect(redis->host, redis->port);
+        conn->c = redis_vtbl_connection_open(conn, redis);
         if(!conn->c) return CONNECTION_ENOMEM;
         if(conn->c->err) {
 #ifndef QUIET
@@ -233,113 +431,583 @@ int redis_vtbl_connection_connect(redis_vtbl_connection *conn) {
 #ifndef QUIET
         fprintf(stderr, "+OK\n");
 #endif
+        if(conn->command_timeout) redisSetTimeout(conn->c, ms_timeval(conn->command_timeout));
+        redis_vtbl_connection_load_scripts(conn);
         return CONNECTION_OK;
     }
 }
 
-static redisReply* redis_vtbl_connection_command_impl(redis_vtbl_connection *conn, redis_vtbl_command *cmd, int retries) {
+/* Retry state of a failed command */
+typedef struct redis_vtbl_retry {
+    int attempt;
+    long long deadline;
+} redis_vtbl_retry;
+
+/* Called after a command could not be sent. Reconnects, backing off exponentially with full jitter
+ * between attempts, until connected or the retry deadline has passed. Returns nonzero if
+ * the command should be sent again. While the circuit is open nothing is attempted. */
+static int redis_vtbl_connection_retry(redis_vtbl_connection *conn, redis_vtbl_retry *retry) {
     int err;
-    redisReply *reply;
+    long long now;
+    long backoff;
+    
+    now = monotonic_ms();
+    if(now < conn->down_until) {
+        strcpy(conn->errstr, "Unavailable; retrying shortly");
+        return 0;
+    }
     
-    reply = redisCommandArgv(conn->c, cmd->args.size, (const char**)cmd->args.data, 0);
-    if(!reply) {
 #ifndef QUIET
-        fprintf(stderr, "-ERR %s\n", conn->c->errstr);
+    if(conn->c) fprintf(stderr, "-ERR %s\n", conn->c->errstr);
 #endif
-        if(retries == 0) {
-            /* free the command, we were unable to reconnect. */
-            redis_vtbl_command_free(cmd);
-            return 0;
+    if(retry->attempt == 0) retry->deadline = now + conn->retry_deadline;
+    
+    for(;;) {
+        if(retry->attempt) {
+            backoff = 10L << (retry->attempt < 7 ? retry->attempt - 1 : 6);    /* 10ms .. 640ms */
+            backoff = rand_r(&conn->jitter) % (backoff + 1);
+            if(now + backoff > retry->deadline) backoff = retry->deadline - now;
+            if(backoff > 0) sleep_ms(backoff);
         }
+        ++retry->attempt;
         
-        /* reconnect / resend */
+        /* reconnect */
         err = redis_vtbl_connection_connect(conn);
-        if(err) {
+        if(!err) return 1;
 #ifndef QUIET
-            if(conn->service) {
-                fprintf(stderr, "Sentinel: %s", conn->errstr);
-            } else {
-                fprintf(stderr, "Redis: %s", conn->errstr);
-            }
-#endif
-            /* free the command, we were unable to reconnect. */
-            redis_vtbl_command_free(cmd);
-            return 0;
+        if(conn->service) {
+            fprintf(stderr, "Sentinel: %s\n", conn->errstr);
+        } else {
+            fprintf(stderr, "Redis: %s\n", conn->errstr);
         }
+#endif
         
-        return redis_vtbl_connection_command_impl(conn, cmd, --retries);
+        now = monotonic_ms();
+        if(now >= retry->deadline) break;
     }
     
-    redis_vtbl_command_free(cmd);
-    return reply;
+    /* open the circuit; fail fast rather than every caller waiting out the deadline */
+    conn->down_until = now + CONNECTION_CIRCUIT_OPEN;
+    return 0;
+}
+
+/* Write the buffered commands out. Returns nonzero once they are written in full; until then
+ * none of them has reached redis whole and they may be sent again on a new connection. */
+static int redis_vtbl_connection_send(redisContext *c) {
+    int done = 0;
+    
+    if(c->err) return 0;
+    while(!done) {
+        if(redisBufferWrite(c, &done) != REDIS_OK) return 0;
+    }
+    return 1;
 }
 
 redisReply* redis_vtbl_connection_command(redis_vtbl_connection *conn, redis_vtbl_command *cmd) {
-    return redis_vtbl_connection_command_impl(conn, cmd, 3);
+    redisReply *reply;
+    redis_vtbl_retry retry;
+    
+    retry.attempt = 0;
+    reply = 0;
+    for(;;) {
+        if(conn->c && monotonic_ms() >= conn->down_until) {
+            redisAppendCommandArgv(conn->c, cmd->args.size, (const char**)cmd->args.data, cmd->lens.data);
+            if(redis_vtbl_connection_send(conn->c)) {
+                /* sent; the command may have run, so a lost reply is not resent */
+                if(redisGetReply(conn->c, (void**)&reply) != REDIS_OK) {
+                    strcpy(conn->errstr, conn->c->errstr);
+                    reply = 0;
+                }
+                break;
+            }
+        }
+        if(!redis_vtbl_connection_retry(conn, &retry)) break;
+    }
+    
+    redis_vtbl_command_free(cmd);
+    return reply;
 }
 
 void redis_vtbl_connection_command_enqueue(redis_vtbl_connection *conn, redis_vtbl_command *cmd) {
     /* optimistically pass the message to hiredis... */
-    redisAppendCommandArgv(conn->c, cmd->args.size, (const char**)cmd->args.data, 0);
+    if(conn->c) redisAppendCommandArgv(conn->c, cmd->args.size, (const char**)cmd->args.data, cmd->lens.data);
     /* ... but queue it incase it needs to be resent */
     vector_push(&conn->cmd_queue, cmd);
 }
 
-static int redis_vtbl_connection_read_queued_impl(redis_vtbl_connection *conn, list_t *replies, int retries) {
+int redis_vtbl_connection_read_queued(redis_vtbl_connection *conn, list_t *replies) {
     int err;
     size_t i;
+    redis_vtbl_command *cmd;
+    redis_vtbl_retry retry;
     
     if(conn->cmd_queue.size == 0) return CONNECTION_ERROR;
     
-    err = redis_n_replies(conn->c, conn->cmd_queue.size, replies);
-    if(err) {
-#ifndef QUIET
-        fprintf(stderr, "-ERR %s\n", conn->c->errstr);
-#endif
-        if(retries == 0) {
-            /* clear the command queue, we were unable to reconnect. */
-            vector_clear(&conn->cmd_queue);
-            return CONNECTION_ERROR;
-        }
-        
-        /* reconnect / resend / reread */
-        err = redis_vtbl_connection_connect(conn);
-        if(err) {
-#ifndef QUIET
-            if(conn->service) {
-                fprintf(stderr, "Sentinel: %s", conn->errstr);
-            } else {
-                fprintf(stderr, "Redis: %s", conn->errstr);
-            }
-#endif
-            /* clear the command queue, we were unable to reconnect. */
-            vector_clear(&conn->cmd_queue);
-            return CONNECTION_ERROR;
+    retry.attempt = 0;
+    err = 1;
+    for(;;) {
+        if(conn->c && monotonic_ms() >= conn->down_until && redis_vtbl_connection_send(conn->c)) {
+            /* sent; the commands may have run, so lost replies are not resent */
+            err = redis_n_replies(conn->c, conn->cmd_queue.size, replies);
+            if(err) strcpy(conn->errstr, conn->c->errstr);
+            break;
         }
+        if(!redis_vtbl_connection_retry(conn, &retry)) break;
         
-        /* resend the queued commands on the new connection. */
+        /* resend the queued commands on the new connection */
         for(i = 0; i < conn->cmd_queue.size; ++i) {
-            redis_vtbl_command *cmd;
-            
             cmd = vector_get(&conn->cmd_queue, i);
-            redisAppendCommandArgv(conn->c, cmd->args.size, (const char**)cmd->args.data, 0);
+            redisAppendCommandArgv(conn->c, cmd->args.size, (const char**)cmd->args.data, cmd->lens.data);
         }
-        
-        return redis_vtbl_connection_read_queued_impl(conn, replies, --retries);
     }
     
     vector_clear(&conn->cmd_queue);
+    if(err) {
+        list_clear(replies);
+        return CONNECTION_ERROR;
+    }
     return CONNECTION_OK;
 }
 
-int redis_vtbl_connection_read_queued(redis_vtbl_connection *conn, list_t *replies) {
-    return redis_vtbl_connection_read_queued_impl(conn, replies, 3);
+/* Lookup the sha of the script, loading it if not yet known.
+ * Returns 0 if the script could not be loaded. */
+static redis_vtbl_script* redis_vtbl_connection_script(redis_vtbl_connection *conn, const char *source) {
+    redis_vtbl_command cmd;
+    redisReply *reply;
+    redis_vtbl_script *script;
+    redis_vtbl_script loaded;
+    
+    script = vector_find(&conn->scripts, source, (int (*)(const void *, const void *))redis_vtbl_script_source_cmp);
+    if(script && script->sha[0]) return script;
+    
+    redis_vtbl_command_init_arg(&cmd, "SCRIPT");
+    redis_vtbl_command_arg(&cmd, "LOAD");
+    redis_vtbl_command_arg(&cmd, source);
+    reply = redis_vtbl_connection_command(conn, &cmd);
+    if(!reply) return 0;
+    
+    if(reply->type != REDIS_REPLY_STRING || reply->len != 40) {
+        freeReplyObject(reply);
+        return 0;
+    }
+    
+    if(!script) {
+        loaded.source = source;
+        loaded.sha[0] = 0;
+        if(vector_push(&conn->scripts, &loaded)) {
+            freeReplyObject(reply);
+            return 0;
+        }
+        script = vector_get(&conn->scripts, conn->scripts.size - 1);
+    }
+    
+    memcpy(script->sha, reply->str, 40);
+    script->sha[40] = 0;
+    freeReplyObject(reply);
+    return script;
+}
+
+redisReply* redis_vtbl_connection_eval(redis_vtbl_connection *conn, const char *source, redis_vtbl_command *cmd) {
+    redis_vtbl_command eval;
+    redisReply *reply;
+    redis_vtbl_script *script;
+    
+    script = redis_vtbl_connection_script(conn, source);
+    if(script) {
+        redis_vtbl_command_init_arg(&eval, "EVALSHA");
+        redis_vtbl_command_arg(&eval, script->sha);
+        redis_vtbl_command_refs(&eval, cmd);
+        reply = redis_vtbl_connection_command(conn, &eval);
+        
+        if(!reply || reply->type != REDIS_REPLY_ERROR || strncmp(reply->str, "NOSCRIPT", 8)) {
+            redis_vtbl_command_free(cmd);
+            return reply;
+        }
+        
+        /* script cache flushed or a different server after reconnect; reload on next use */
+        freeReplyObject(reply);
+        script->sha[0] = 0;
+    }
+    
+    redis_vtbl_command_init_arg(&eval, "EVAL");
+    redis_vtbl_command_arg(&eval, source);
+    redis_vtbl_command_refs(&eval, cmd);
+    reply = redis_vtbl_connection_command(conn, &eval);
+    redis_vtbl_command_free(cmd);
+    return reply;
+}
+
+int redis_vtbl_connection_script_register(redis_vtbl_connection *conn, const char *source) {
+    redis_vtbl_script script;
+    
+    if(vector_find(&conn->scripts, source, (int (*)(const void *, const void *))redis_vtbl_script_source_cmp))
+        return CONNECTION_OK;
+    
+    script.source = source;
+    script.sha[0] = 0;
+    if(vector_push(&conn->scripts, &script)) return CONNECTION_ENOMEM;
+    return CONNECTION_OK;
+}
+
+const char* redis_vtbl_connection_script_sha(redis_vtbl_connection *conn, const char *source) {
+    redis_vtbl_script *script;
+    
+    script = redis_vtbl_connection_script(conn, source);
+    return script ? script->sha : 0;
 }
 
 void redis_vtbl_connection_free(redis_vtbl_connection *conn) {
+    if(conn->watch) redisFree(conn->watch);
+    vector_free(&conn->replicas);
     free(conn->service);
+    free(conn->local_socket);
     vector_free(&conn->addresses);
     if(conn->c) redisFree(conn->c);
     vector_free(&conn->cmd_queue);
+    vector_free(&conn->scripts);
+}
+
+/* Shared connections are kept in a process wide list protected by registry_lock.
+ * The connection is the first member so the entry is found from it directly. */
+typedef struct redis_vtbl_shared {
+    redis_vtbl_connection conn;
+    char *config;
+    const void *owner;
+    size_t refs;
+    struct redis_vtbl_shared *next;
+} redis_vtbl_shared;
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static redis_vtbl_shared *registry = 0;
+
+int redis_vtbl_connection_acquire(redis_vtbl_connection **conn, const char *config, const void *owner,
+        long connect_ms, long command_ms, long retry_ms) {
+    int err;
+    redis_vtbl_shared *shared;
+    size_t len;
+    
+    config = trim_ws(config);
+    for(len = strlen(config); len && isspace(config[len-1]); --len);
+    
+    if(connect_ms < 0) connect_ms = CONNECTION_CONNECT_TIMEOUT;
+    if(command_ms < 0) command_ms = CONNECTION_COMMAND_TIMEOUT;
+    if(retry_ms < 0) retry_ms = CONNECTION_RETRY_DEADLINE;
+    
+    pthread_mutex_lock(&registry_lock);
+    for(shared = registry; shared; shared = shared->next) {
+        if(shared->owner == owner && !strncmp(shared->config, config, len) && !shared->config[len] &&
+                shared->conn.connect_timeout == connect_ms && shared->conn.command_timeout == command_ms &&
+                shared->conn.retry_deadline == retry_ms) {
+            ++shared->refs;
+            *conn = &shared->conn;
+            pthread_mutex_unlock(&registry_lock);
+            return CONNECTION_OK;
+        }
+    }
+    
+    shared = malloc(sizeof(redis_vtbl_shared));
+    if(!shared) {
+        pthread_mutex_unlock(&registry_lock);
+        return CONNECTION_ENOMEM;
+    }
+    shared->config = strndup(config, len);
+    if(!shared->config) {
+        free(shared);
+        pthread_mutex_unlock(&registry_lock);
+        return CONNECTION_ENOMEM;
+    }
+    
+    err = redis_vtbl_connection_init(&shared->conn, config);
+    if(err) {
+        free(shared->config);
+        free(shared);
+        pthread_mutex_unlock(&registry_lock);
+        return err;
+    }
+    redis_vtbl_connection_timeouts(&shared->conn, connect_ms, command_ms, retry_ms);
+    
+    shared->owner = owner;
+    shared->refs = 1;
+    shared->next = registry;
+    registry = shared;
+    pthread_mutex_unlock(&registry_lock);
+    
+    *conn = &shared->conn;
+    return CONNECTION_OK;
+}
+
+void redis_vtbl_connection_release(redis_vtbl_connection *conn) {
+    redis_vtbl_shared **link;
+    redis_vtbl_shared *shared;
+    
+    shared = (redis_vtbl_shared*)conn;
+    
+    pthread_mutex_lock(&registry_lock);
+    if(--shared->refs) {
+        pthread_mutex_unlock(&registry_lock);
+        return;
+    }
+    for(link = &registry; *link != shared; link = &(*link)->next);
+    *link = shared->next;
+    pthread_mutex_unlock(&registry_lock);
+    
+    redis_vtbl_connection_free(&shared->conn);
+    free(shared->config);
+    free(shared);
+}
+
+static void redis_vtbl_replica_free(redis_vtbl_replica *replica) {
+    address_free(&replica->address);
+    if(replica->conn) {
+        redis_vtbl_connection_free(replica->conn);
+        free(replica->conn);
+    }
+}
+
+/* Usable replicas per the master's INFO replication e.g.
+ * master_repl_offset:1234
+ * slave0:ip=10.0.0.2,port=6379,state=online,offset=1234,lag=0 */
+static void redis_vtbl_connection_replicas_check(redis_vtbl_connection *conn) {
+    redis_vtbl_command cmd;
+    redisReply *reply;
+    redis_vtbl_replica *replica;
+    const char *line;
+    long long offset;
+    long lag;
+    int port;
+    char ip[64];
+    char state[32];
+    size_t i;
+    
+    for(i = 0; i < conn->replicas.size; ++i) {
+        replica = vector_get(&conn->replicas, i);
+        replica->online = 0;
+    }
+    
+    /* sentinel knows the replicas of the service; asked again after a failover.
+     * Replicas are only ever added as cursors may hold their connections. */
+    if(conn->replicas.size == 0 || conn->replica_checked < 0) {
+        vector_t found;
+        address_t *address;
+        redis_vtbl_replica added;
+        size_t j;
+        
+        vector_init(&found, sizeof(address_t), (void(*)(void*))address_free);
+        redisSentinelReplicas(&conn->addresses, conn->service, conn->connect_timeout, &found);
+        for(i = 0; i < found.size; ++i) {
+            address = vector_get(&found, i);
+            for(j = 0; j < conn->replicas.size; ++j) {
+                replica = vector_get(&conn->replicas, j);
+                if(!address_cmp(&replica->address, address)) break;
+            }
+            if(j < conn->replicas.size) continue;
+            
+            added.address = *address;
+            added.conn = 0;
+            added.online = 0;
+            added.lag = 0;
+            added.offset = 0;
+            vector_push(&conn->replicas, &added);
+        }
+        vector_free(&found);
+        if(conn->replicas.size == 0) return;
+    }
+    
+    /* the master knows how far behind each is */
+    redis_vtbl_command_init_arg(&cmd, "INFO");
+    redis_vtbl_command_arg(&cmd, "replication");
+    reply = redis_vtbl_connection_command(conn, &cmd);
+    if(!reply) return;
+    if(reply->type != REDIS_REPLY_STRING && reply->type != REDIS_REPLY_STATUS) {
+        freeReplyObject(reply);
+        return;
+    }
+    
+    conn->master_offset = 0;
+    line = strstr(reply->str, "master_repl_offset:");
+    if(line) conn->master_offset = strtoll(line + 19, 0, 10);
+    
+    for(line = reply->str; line; line = strchr(line, '\n')) {
+        while(*line == '\n' || *line == '\r') ++line;
+        if(strncmp(line, "slave", 5)) continue;
+        if(sscanf(line, "slave%*d:ip=%63[^,],port=%d,state=%31[^,],offset=%lld,lag=%ld", ip, &port, state, &offset, &lag) != 5)
+            continue;
+        
+        for(i = 0; i < conn->replicas.size; ++i) {
+            replica = vector_get(&conn->replicas, i);
+            if(replica->address.port != port || strcmp(replica->address.host, ip)) continue;
+            replica->online = !strcmp(state, "online");
+            replica->lag = lag;
+            replica->offset = offset;
+        }
+    }
+    freeReplyObject(reply);
+}
+
+/* Connection to the replica sharing the timeouts & scripts of its master */
+static redis_vtbl_connection* redis_vtbl_replica_connection(redis_vtbl_connection *conn, redis_vtbl_replica *replica) {
+    char config[ADDRESS_MAX_HOST_LEN + 16];
+    redis_vtbl_script *script;
+    
+    if(!replica->conn) {
+        replica->conn = malloc(sizeof(redis_vtbl_connection));
+        if(!replica->conn) return 0;
+        
+        snprintf(config, sizeof(config), "%s:%d", replica->address.host, replica->address.port);
+        if(redis_vtbl_connection_init(replica->conn, config)) {
+            free(replica->conn);
+            replica->conn = 0;
+            return 0;
+        }
+        redis_vtbl_connection_timeouts(replica->conn, conn->connect_timeout, conn->command_timeout, conn->retry_deadline);
+        for(script = vector_begin(&conn->scripts); script != vector_end(&conn->scripts); ++script)
+            redis_vtbl_connection_script_register(replica->conn, script->source);
+    }
+    
+    if(!replica->conn->c && redis_vtbl_connection_connect(replica->conn))
+        return 0;
+    return replica->conn;
+}
+
+redis_vtbl_connection* redis_vtbl_connection_reader(redis_vtbl_connection *conn, int fresh, long max_lag) {
+    redis_vtbl_replica *replica;
+    redis_vtbl_connection *reader;
+    long long now;
+    size_t i;
+    size_t n;
+    
+    if(max_lag < 0 || !conn->service) return conn;
+    
+    now = monotonic_ms();
+    if(fresh || conn->replica_checked <= 0 || now - conn->replica_checked >= CONNECTION_REPLICA_CHECK) {
+        redis_vtbl_connection_replicas_check(conn);
+        conn->replica_checked = now;
+    }
+    
+    n = conn->replicas.size;
+    for(i = 0; i < n; ++i) {
+        replica = vector_get(&conn->replicas, (conn->replica_next + i) % n);
+        if(!replica->online || replica->lag > max_lag) continue;
+        if(fresh && replica->offset < conn->master_offset) continue;
+        
+        reader = redis_vtbl_replica_connection(conn, replica);
+        if(!reader) {
+            replica->online = 0;
+            continue;
+        }
+        conn->replica_next = (conn->replica_next + i + 1) % n;
+        return reader;
+    }
+    return conn;
 }
 
+/* Subscribe to +switch-master on the first sentinel that accepts */
+static void redis_vtbl_connection_watch_open(redis_vtbl_connection *conn) {
+    size_t i;
+    address_t *sentinel;
+    redisContext *c;
+    redisReply *reply;
+    long long now;
+    
+    now = monotonic_ms();
+    if(now < conn->watch_retry) return;
+    conn->watch_retry = now + CONNECTION_WATCH_RETRY;
+    
+    for(i = 0; i < conn->addresses.size; ++i) {
+        sentinel = vector_get(&conn->addresses, i);
+        c = redisConnectWithTimeout(sentinel->host, sentinel->port, ms_timeval(SENTINEL_PROBE_MS(conn->connect_timeout)));
+        if(!c) return;
+        if(c->err) {
+            redisFree(c);
+            continue;
+        }
+        
+        redisSetTimeout(c, ms_timeval(SENTINEL_PROBE_MS(conn->connect_timeout)));
+        reply = redisCommand(c, "SUBSCRIBE +switch-master");
+        if(reply && reply->type == REDIS_REPLY_ARRAY) {
+            freeReplyObject(reply);
+            conn->watch = c;
+            return;
+        }
+        if(reply) freeReplyObject(reply);
+        redisFree(c);
+    }
+}
+
+/* Connect to the master announced by sentinel, via the local socket if it is on this host.
+ * Falls back to asking the sentinels. */
+static void redis_vtbl_connection_switch(redis_vtbl_connection *conn, const char *host, int port) {
+    address_t master;
+    address_t local;
+    redisContext *c;
+    
+    c = 0;
+    if(!address_init(&master, host, port)) {
+        if(conn->local_socket && address_local_p(&master) && !address_init(&local, conn->local_socket, 0))
+            c = redis_vtbl_connection_open(conn, &local);
+        if(!c || c->err) {
+            if(c) redisFree(c);
+            c = redis_vtbl_connection_open(conn, &master);
+        }
+    }
+    
+    /* replicas are rediscovered on the next read; cursors may still hold their connections */
+    conn->replica_checked = -CONNECTION_REPLICA_CHECK;
+    
+    if(!c || c->err) {
+        if(c) redisFree(c);
+        redis_vtbl_connection_connect(conn);
+        return;
+    }
+    
+    if(conn->c) redisFree(conn->c);
+    conn->c = c;
+    conn->master = master;
+    conn->down_until = 0;
+    if(conn->command_timeout) redisSetTimeout(conn->c, ms_timeval(conn->command_timeout));
+    redis_vtbl_connection_load_scripts(conn);
+}
+
+void redis_vtbl_connection_watch(redis_vtbl_connection *conn) {
+    redisReply *reply;
+    struct pollfd pfd;
+    char service[256];
+    char host[ADDRESS_MAX_HOST_LEN];
+    int port;
+    
+    if(!conn->service) return;
+    if(!conn->watch) redis_vtbl_connection_watch_open(conn);
+    if(!conn->watch) return;
+    
+    for(;;) {
+        reply = 0;
+        if(redisGetReplyFromReader(conn->watch, (void**)&reply) != REDIS_OK)
+            break;
+        
+        if(!reply) {
+            /* nothing buffered; read whatever has arrived without waiting */
+            pfd.fd = conn->watch->fd;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            if(poll(&pfd, 1, 0) <= 0) return;
+            if(redisBufferRead(conn->watch) != REDIS_OK) break;
+            continue;
+        }
+        
+        /* message +switch-master "<service> <old ip> <old port> <new ip> <new port>" */
+        if(reply->type == REDIS_REPLY_ARRAY && reply->elements == 3 &&
+                reply->element[2]->type == REDIS_REPLY_STRING &&
+                sscanf(reply->element[2]->str, "%255s %*s %*s %255s %d", service, host, &port) == 3 &&
+                !strcmp(service, conn->service)) {
+#ifndef QUIET
+            fprintf(stderr, "redis_vtbl: Sentinel switched master to %s:%d\n", host, port);
+#endif
+            redis_vtbl_connection_switch(conn, host, port);
+        }
+        freeReplyObject(reply);
+    }
+    
+    /* subscription lost; renewed on a later call */
+    redisFree(conn->watch);
+    conn->watch = 0;
+}
@@ -9,6 +9,7 @@
 #define CONNECTION_H_
 #include "vector.h"
 #include "list.h"
+#include "address.h"
 #include <hiredis/hiredis.h>
 
 enum {
@@ -21,28 +22,74 @@ enum {
 typedef struct redis_vtbl_connection {
     char *service;                  /* sentinel service name; optional */
     vector_t addresses;             /* list of redis/sentinel addresses */
+    char *local_socket;             /* unix socket path for a sentinel reported master on this host; optional */
+    int quorum;                     /* sentinels that must agree on the master; default 1 */
+    address_t master;               /* last master reported by sentinel; host empty if none */
     char errstr[128];               /* error string from redis */
     redisContext *c;
     vector_t cmd_queue;
+    vector_t scripts;               /* sha1 of the lua scripts loaded via SCRIPT LOAD */
+    
+    long connect_timeout;           /* ms; 0 none */
+    long command_timeout;           /* ms; 0 none */
+    long retry_deadline;            /* ms a command that could not be sent is retried for */
+    long long down_until;           /* monotonic ms until which commands fail fast (circuit open) */
+    unsigned int jitter;            /* rand_r state for the reconnect backoff */
+    
+    vector_t replicas;              /* redis_vtbl_replica of the sentinel service */
+    size_t replica_next;            /* next replica to read from in turn */
+    long long master_offset;        /* replication offset of the master when last checked */
+    long long replica_checked;      /* monotonic ms the replicas were last checked */
+    
+    redisContext *watch;            /* sentinel subscription to +switch-master */
+    long long watch_retry;          /* monotonic ms after which a lost subscription is renewed */
 } redis_vtbl_connection;
 
+typedef struct redis_vtbl_replica {
+    address_t address;
+    struct redis_vtbl_connection *conn;     /* connected on first use */
+    int online;                     /* online per the master and connectable */
+    long lag;                       /* replication lag (s) reported by the master */
+    long long offset;               /* replication offset acknowledged to the master */
+} redis_vtbl_replica;
+
+#define CONNECTION_CONNECT_TIMEOUT 1000
+#define CONNECTION_COMMAND_TIMEOUT 10000
+#define CONNECTION_RETRY_DEADLINE  2000
+/* Commands fail fast for this long once retries are exhausted */
+#define CONNECTION_CIRCUIT_OPEN    1000
+/* Interval at which the replication state of the replicas is checked */
+#define CONNECTION_REPLICA_CHECK   1000
+/* Interval at which a sentinel subscription is attempted while there is none */
+#define CONNECTION_WATCH_RETRY     1000
+
 typedef struct redis_vtbl_command {
-    list_t args;
+    list_t args;                    /* argument data; binary safe */
+    vector_t lens;                  /* length of each argument */
+    list_t owned;                   /* argument data allocated by the command */
 } redis_vtbl_command;
 
 int  redis_vtbl_command_init(redis_vtbl_command *cmd);
 int  redis_vtbl_command_init_arg(redis_vtbl_command *cmd, const char *arg);
 int  redis_vtbl_command_arg(redis_vtbl_command *cmd, const char *arg);
 int  redis_vtbl_command_arg_fmt(redis_vtbl_command *cmd, const char *arg, ...);
+/* copy of len bytes of arg */
+int  redis_vtbl_command_arg_len(redis_vtbl_command *cmd, const void *arg, size_t len);
+/* arg is referenced, not copied; it must remain valid until the command is sent */
+int  redis_vtbl_command_arg_ref(redis_vtbl_command *cmd, const void *arg, size_t len);
+/* append copies of the arguments of src to cmd */
+int  redis_vtbl_command_args(redis_vtbl_command *cmd, const redis_vtbl_command *src);
+int  redis_vtbl_command_copy(redis_vtbl_command *cmd, const redis_vtbl_command *src);
 void redis_vtbl_command_free(redis_vtbl_command *cmd);
 
 /* Initialise a new connection object from the given configuration.
  *
- * address[:port]
+ * address[:port] | unix:/path
  * A connection to a single redis instance
  *
- * sentinel service-name address[:port][ address[:port]...]
- * A connection to the redis sentinel service at the given addresses. */
+ * sentinel service-name address[:port][ address[:port]...][ unix:/path]
+ * A connection to the redis sentinel service at the given addresses.
+ * If the master is on this host it is connected through the unix socket at path. */
 int  redis_vtbl_connection_init(redis_vtbl_connection *conn, const char *config);
 
 /* Attempt to connect to the specified redis / sentinel host(s)
@@ -51,11 +98,61 @@ int  redis_vtbl_connection_init(redis_vtbl_connection *conn, const char *config)
  * provided by redis. */
 int  redis_vtbl_connection_connect(redis_vtbl_connection *conn);
 
+/* Set the connect & command timeouts and the retry deadline in ms; negative values are unchanged.
+ * A command that could not be sent is retried on a new connection with exponential backoff
+ * and jitter until the retry deadline has passed, after which the connection fails fast for
+ * CONNECTION_CIRCUIT_OPEN ms. A command that was sent is never resent; if its reply is lost
+ * or times out the command fails, as it may already have run. */
+void redis_vtbl_connection_timeouts(redis_vtbl_connection *conn, long connect_ms, long command_ms, long retry_ms);
+
+/* Poll the sentinel subscription of the connection without blocking. If sentinel has
+ * announced a new master for the service (+switch-master) the connection is moved to it
+ * before the next command rather than after one fails. Call ahead of each statement;
+ * no-op for a single redis instance. */
+void redis_vtbl_connection_watch(redis_vtbl_connection *conn);
+
 /* both of these commands take ownership of the cmd object */
 redisReply* redis_vtbl_connection_command(redis_vtbl_connection *conn, redis_vtbl_command *cmd);
 void redis_vtbl_connection_command_enqueue(redis_vtbl_connection *conn, redis_vtbl_command *cmd);
 int  redis_vtbl_connection_read_queued(redis_vtbl_connection *conn, list_t *replies);
 
+/* Evaluate the lua script via EVALSHA, loading it with SCRIPT LOAD on first use.
+ * Scripts are identified by the address of their source; it must remain valid
+ * for the lifetime of the connection.
+ * cmd holds the arguments following the script i.e. numkeys key [key...] arg [arg...]
+ * Falls back to EVAL if the server does not know the script (NOSCRIPT).
+ * Takes ownership of the cmd object. */
+redisReply* redis_vtbl_connection_eval(redis_vtbl_connection *conn, const char *script, redis_vtbl_command *cmd);
+
+/* Register a lua script to be loaded with SCRIPT LOAD whenever the connection is
+ * (re)established. The source must remain valid for the lifetime of the connection. */
+int  redis_vtbl_connection_script_register(redis_vtbl_connection *conn, const char *script);
+
+/* SCRIPT LOAD all registered scripts; done by redis_vtbl_connection_connect. */
+int  redis_vtbl_connection_load_scripts(redis_vtbl_connection *conn);
+
+/* The sha1 of the lua script for EVALSHA within a pipeline or MULTI block,
+ * loading it with SCRIPT LOAD if not yet known. Returns 0 on failure. */
+const char* redis_vtbl_connection_script_sha(redis_vtbl_connection *conn, const char *script);
+
 void redis_vtbl_connection_free(redis_vtbl_connection *conn);
 
+/* Read replicas
+ * The connection for the next read: a replica of the sentinel service, taken in turn, whose
+ * replication lag as reported by the master is at most max_lag seconds, or conn itself.
+ * max_lag < 0 or a connection without sentinel always reads from conn.
+ * fresh requires the replica to have acknowledged every write the master has received,
+ * e.g. after the caller wrote. */
+redis_vtbl_connection* redis_vtbl_connection_reader(redis_vtbl_connection *conn, int fresh, long max_lag);
+
+/* Shared connections
+ * Users passing the same owner, configuration and timeouts (ms; -1 default, as for
+ * redis_vtbl_connection_timeouts) share one initialised connection, which is freed when
+ * the last of them releases it. A connection is not thread safe; owner identifies the
+ * context it is used from e.g. a database handle.
+ * The connection is not connected by acquire; check conn->c. */
+int  redis_vtbl_connection_acquire(redis_vtbl_connection **conn, const char *config, const void *owner,
+        long connect_ms, long command_ms, long retry_ms);
+void redis_vtbl_connection_release(redis_vtbl_connection *conn);
+
 #endif /* CONNECTION_H_ */
@@ -10,10 +10,14 @@ SQLITE_EXTENSION_INIT1
 
 #include <hiredis/hiredis.h>
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
 #include <ctype.h>
 #include <limits.h>
 #include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
 
 /* A redis backed sqlite3 virtual table implementation.
  * prefix.db.table:[rowid]      = hash of the row data.
@@ -21,15 +25,48 @@ SQLITE_EXTENSION_INIT1
  * prefix.db.table.index.rowid  = master index (zset) of rows in the table
  * prefix.db.table.indices      = master index (set) of indices on the table
  * prefix.db.table.index:x      = value zset index for column x
- * prefix.db.table.index:x:val  = rowid map for value val in column x */
+ * prefix.db.table.index:x:val  = rowid map for value val in column x
+ * prefix.db.table.generation   = count of the script calls that changed the rows in the table
+ * prefix.db.table.truncate...  = keys of a truncate being carried out */
+
+struct redis_vtbl_flusher;
+
+/* A batch of buffered writes */
+typedef struct redis_vtbl_pending {
+    vector_t writes;
+    list_t expected;
+    size_t rows;
+} redis_vtbl_pending;
 
 typedef struct redis_vtbl_vtab {
     sqlite3_vtab base;
+    sqlite3 *db;
     
-    redis_vtbl_connection conn;
+    redis_vtbl_connection *conn;    /* shared by the tables of the database on the same redis */
     char *key_base;
     
     vector_t columns;
+    
+    sqlite3_int64 rowid_next;       /* next unused rowid of the reserved block */
+    sqlite3_int64 rowid_last;       /* last rowid of the reserved block */
+    long long rowid_block;          /* size of the next block; adapts to the insert rate */
+    long long rowid_block_max;      /* rowid_block=N table option */
+    time_t rowid_time;              /* time the last block was reserved */
+    
+    vector_t writes;                /* mutations buffered until the transaction commits */
+    list_t writes_expected;         /* predicates for the EXEC reply of each buffered write */
+    size_t writes_rows;             /* rows written by the buffered writes */
+    const char *batch_script;       /* script of the last buffered write ... */
+    size_t batch_rows;              /* ... and the rows it holds */
+    vector_t spilled;               /* redis_vtbl_pending of VTAB_WRITES_MAX rows buffered ahead of writes */
+    vector_t deletes;               /* rowids of deletes buffered ahead of any other write */
+    int write_behind;               /* write_behind=1 table option */
+    long timeouts[3];               /* connect_timeout, command_timeout & retry_deadline (ms) table options; -1 unset */
+    long read_replicas;             /* read_replicas=N table option; greatest lag (s) of a replica read from; -1 unset */
+    int writing;                    /* within a transaction that writes the table */
+    int written;                    /* the table was written since a replica was last read */
+    struct redis_vtbl_flusher *flusher;     /* thread sending committed writes if write_behind */
+    int unlink;                     /* unlink=1 table option; truncate with UNLINK */
 } redis_vtbl_vtab;
 
 static int redis_vtbl_create(sqlite3 *db, void *pAux, int argc, const char *const*argv, sqlite3_vtab **ppVTab, char **pzErr);
@@ -38,6 +75,10 @@ static int redis_vtbl_bestindex(sqlite3_vtab *pVTab, sqlite3_index_info *pIndexI
 static int redis_vtbl_update(sqlite3_vtab *pVTab, int argc, sqlite3_value **argv, sqlite3_int64 *pRowid);
 static int redis_vtbl_disconnect(sqlite3_vtab *pVTab);
 static int redis_vtbl_destroy(sqlite3_vtab *pVTab);
+static int redis_vtbl_begin(sqlite3_vtab *pVTab);
+static int redis_vtbl_sync(sqlite3_vtab *pVTab);
+static int redis_vtbl_commit(sqlite3_vtab *pVTab);
+static int redis_vtbl_rollback(sqlite3_vtab *pVTab);
 
 static void redis_vtbl_func_createindex(sqlite3_context *ctx, int argc, sqlite3_value **argv);
 
@@ -50,24 +91,80 @@ enum {
     CURSOR_INDEX_ROWID_GE,
     CURSOR_INDEX_ROWID_LE,
     
-    CURSOR_INDEX_NAMED_EQ,
-    CURSOR_INDEX_NAMED_GT,
-    CURSOR_INDEX_NAMED_LT,
-    CURSOR_INDEX_NAMED_GE,
-    CURSOR_INDEX_NAMED_LE,
+    CURSOR_INDEX_LOOKUP,
+    
+    CURSOR_INDEX_ORDERED,
 };
 
+/* Query plan passed from xBestIndex to xFilter.
+ * idxNum selects the access path, idxStr carries the rest of the plan
+ * as space separated key=value tokens.
+ * columns=x         colUsed mask (hex) of the columns referenced by the statement
+ * index=n           column number of the index walked by CURSOR_INDEX_ORDERED
+ * order=1|-1        rows are returned in ascending | descending order of rowid or the ordered index
+ * lookup=n:op,...   indexed constraints intersected by CURSOR_INDEX_LOOKUP
+ * filter=n:op,...   constraints evaluated by redis while scanning
+ * limit=n offset=n  argv position of the LIMIT and OFFSET values applied by the cursor
+ * Terms are column number and SQLITE_INDEX_CONSTRAINT_* op in argv order */
+#define PLAN_OP_IN 0            /* lookup term is an IN list processed all at once */
+
+typedef struct redis_vtbl_plan_term {
+    int column;
+    int op;
+} redis_vtbl_plan_term;
+
+typedef struct redis_vtbl_plan {
+    sqlite3_uint64 columns;
+    int index;
+    int order;
+    int limit;
+    int offset;
+    vector_t lookup;
+    vector_t filter;
+} redis_vtbl_plan;
+
+static void redis_vtbl_plan_init(redis_vtbl_plan *plan);
+static char* redis_vtbl_plan_format(redis_vtbl_plan *plan);
+static int redis_vtbl_plan_parse(redis_vtbl_plan *plan, const char *idxStr);
+static void redis_vtbl_plan_free(redis_vtbl_plan *plan);
+
 typedef struct redis_vtbl_cursor {
     sqlite3_vtab_cursor base;
     redis_vtbl_vtab *vtab;
+    redis_vtbl_connection *conn;        /* the table's connection or a read replica */
+    
+    vector_t projection;                /* column numbers retrieved for each row */
     
     vector_t rows;
     sqlite3_int64 *current_row;
     
-    list_t column_data;
+    int scan;                           /* rows are paged in from the rowid index as the cursor advances */
+    int scan_order;                     /* 1 | -1 ascending | descending */
+    int scan_index;                     /* column number of the index walked in order; -1 the rowid index */
+    char scan_min[32];                  /* ZRANGEBYSCORE bounds of the next page */
+    char scan_max[32];
+    long long scan_offset;              /* rank of the next page of scan_index values */
+    long long scan_page;                /* rowids or values requested by the next page */
+    long long skip;                     /* matching rows still to be skipped for OFFSET */
+    long long limit;                    /* matching rows still to be returned for LIMIT; -1 unlimited */
+    
+    int counting;                       /* rows are only counted (count(*)); rowids are paged in if requested */
+    long long count;
+    long long count_pos;
+    list_t filter;                      /* column, op, value, type quads evaluated by the filter script */
+    
+    list_t row_data;                    /* pipelined HMGET replies for rows [row_data_begin, row_data_begin + row_data.size) */
+    sqlite3_int64 *row_data_begin;
+    size_t batch_size;                  /* number of rows to retrieve in the next batch */
+    
+    list_t column_data;                 /* redisReply* elements of row_data by column number */
     int column_data_valid;
 } redis_vtbl_cursor;
 
+#define CURSOR_BATCH_MAX 1024
+#define CURSOR_SCAN_PAGE 512
+#define CURSOR_SCAN_GROWTH 4                /* ordered scans start with a single rowid or value */
+
 static int redis_vtbl_cursor_open(sqlite3_vtab *pVTab, sqlite3_vtab_cursor **ppCursor);
 static int redis_vtbl_cursor_close(sqlite3_vtab_cursor *pCursor);
 static int redis_vtbl_cursor_filter(sqlite3_vtab_cursor *pCursor, int idxNum, const char *idxStr, int argc, sqlite3_value **argv);
@@ -94,6 +191,129 @@ static int string_append(char** str, const char* src) {
     return 0;
 }
 
+/*-----------------------------------------------------------------------------
+ * Query plan
+ *----------------------------------------------------------------------------*/
+
+static void redis_vtbl_plan_init(redis_vtbl_plan *plan) {
+    plan->columns = ~(sqlite3_uint64)0;
+    plan->index = -1;
+    plan->order = 0;
+    plan->limit = -1;
+    plan->offset = -1;
+    vector_init(&plan->lookup, sizeof(redis_vtbl_plan_term), 0);
+    vector_init(&plan->filter, sizeof(redis_vtbl_plan_term), 0);
+}
+
+static void redis_vtbl_plan_format_terms(char **s, const char *key, vector_t *terms) {
+    char buf[64];
+    size_t i;
+    
+    for(i = 0; i < terms->size; ++i) {
+        redis_vtbl_plan_term *term = vector_get(terms, i);
+        snprintf(buf, sizeof(buf), "%s%s%d:%d", i ? "" : key, i ? "," : "", term->column, term->op);
+        string_append(s, buf);
+    }
+}
+
+static char* redis_vtbl_plan_format(redis_vtbl_plan *plan) {
+    char *s = 0;
+    char buf[64];
+    char *idxStr;
+    
+    snprintf(buf, sizeof(buf), "columns=%llx index=%d", (unsigned long long)plan->columns, plan->index);
+    string_append(&s, buf);
+    
+    if(plan->order) {
+        snprintf(buf, sizeof(buf), " order=%d", plan->order);
+        string_append(&s, buf);
+    }
+    if(plan->limit >= 0) {
+        snprintf(buf, sizeof(buf), " limit=%d", plan->limit);
+        string_append(&s, buf);
+    }
+    if(plan->offset >= 0) {
+        snprintf(buf, sizeof(buf), " offset=%d", plan->offset);
+        string_append(&s, buf);
+    }
+    
+    redis_vtbl_plan_format_terms(&s, " lookup=", &plan->lookup);
+    redis_vtbl_plan_format_terms(&s, " filter=", &plan->filter);
+    if(!s) return 0;
+    
+    idxStr = sqlite3_mprintf("%s", s);
+    free(s);
+    return idxStr;
+}
+
+static int redis_vtbl_plan_parse_terms(vector_t *terms, const char *str) {
+    redis_vtbl_plan_term term;
+    char *end;
+    
+    while(*str) {
+        errno = 0;
+        term.column = strtol(str, &end, 10);
+        if(errno || *end != ':') return 1;
+        term.op = strtol(end + 1, &end, 10);
+        if(errno || (*end && *end != ',')) return 1;
+        
+        if(vector_push(terms, &term)) return 1;
+        str = *end ? end + 1 : end;
+    }
+    return 0;
+}
+
+static int redis_vtbl_plan_parse(redis_vtbl_plan *plan, const char *idxStr) {
+    int err;
+    size_t i;
+    list_t tok_list;
+    char *end;
+    
+    redis_vtbl_plan_init(plan);
+    if(!idxStr) return 0;
+    
+    err = list_strtok(&tok_list, idxStr, " ");
+    if(err) return 1;
+    
+    for(i = 0; i < tok_list.size && !err; ++i) {
+        const char *tok = list_get(&tok_list, i);
+        
+        errno = 0;
+        if(!strncmp(tok, "columns=", 8)) {
+            plan->columns = strtoull(tok + 8, &end, 16);
+            err = errno || *end;        /* out-of-range | rubbish characters */
+        } else if(!strncmp(tok, "index=", 6)) {
+            plan->index = strtol(tok + 6, &end, 10);
+            err = errno || *end;
+        } else if(!strncmp(tok, "order=", 6)) {
+            plan->order = strtol(tok + 6, &end, 10);
+            err = errno || *end;
+        } else if(!strncmp(tok, "limit=", 6)) {
+            plan->limit = strtol(tok + 6, &end, 10);
+            err = errno || *end;
+        } else if(!strncmp(tok, "offset=", 7)) {
+            plan->offset = strtol(tok + 7, &end, 10);
+            err = errno || *end;
+        } else if(!strncmp(tok, "lookup=", 7)) {
+            err = redis_vtbl_plan_parse_terms(&plan->lookup, tok + 7);
+        } else if(!strncmp(tok, "filter=", 7)) {
+            err = redis_vtbl_plan_parse_terms(&plan->filter, tok + 7);
+        }
+    }
+    
+    list_free(&tok_list);
+    if(err) {
+        redis_vtbl_plan_free(plan);
+        return 1;
+    }
+    return 0;
+}
+
+static void redis_vtbl_plan_free(redis_vtbl_plan *plan) {
+    vector_free(&plan->lookup);
+    vector_free(&plan->filter);
+}
+
 /*-----------------------------------------------------------------------------
  * Column definition
  *----------------------------------------------------------------------------*/
@@ -113,6 +333,9 @@ static int column_type_text_p(const char *data_type) {
 static int column_type_float_p(const char *data_type) {
     return !strncasecmp(data_type, "REAL", 4) || !strncasecmp(data_type, "FLOA", 4) || !strncasecmp(data_type, "DOUB", 4);
 }
+static int column_type_blob_p(const char *data_type) {
+    return !strncasecmp(data_type, "BLOB", 4);
+}
 
 static int redis_vtbl_column_spec_init(redis_vtbl_column_spec *cspec, const char *column_def) {
     int err;
@@ -146,6 +369,9 @@ static int redis_vtbl_column_spec_init(redis_vtbl_column_spec *cspec, const char
         
         else if(column_type_float_p(data_type))
             cspec->data_type = SQLITE_FLOAT;
+        
+        else if(column_type_blob_p(data_type))
+            cspec->data_type = SQLITE_BLOB;
     }
     
     cspec->indexed = 0;
@@ -154,10 +380,6 @@ static int redis_vtbl_column_spec_init(redis_vtbl_column_spec *cspec, const char
     return 0;
 }
 
-static int redis_vtbl_column_spec_name_cmp(const char *l, const redis_vtbl_column_spec *r) {
-    return strcmp(l, r->name);
-}
-
 static void redis_vtbl_column_spec_free(redis_vtbl_column_spec *cspec) {
     free(cspec->name);
 }
@@ -167,27 +389,36 @@ static void redis_vtbl_column_spec_free(redis_vtbl_column_spec *cspec) {
  * Redis backed Virtual table
  *----------------------------------------------------------------------------*/
 
-static int redis_vtbl_vtab_init(redis_vtbl_vtab *vtab, const char *conn_config, const char *db, const char *table, const char *prefix, char **pzErr);
+static int redis_vtbl_vtab_init(redis_vtbl_vtab *vtab, const char *db, const char *table, const char *prefix);
+static int redis_vtbl_vtab_option(redis_vtbl_vtab *vtab, const char *option, char **pzErr);
 static int redis_vtbl_vtab_update_indices(redis_vtbl_vtab *vtab);
+static long long redis_vtbl_vtab_rowid_block(redis_vtbl_vtab *vtab);
 static int redis_vtbl_vtab_generate_rowid(redis_vtbl_vtab *vtab, sqlite3_int64 *rowid);
+static void redis_vtbl_vtab_write(redis_vtbl_vtab *vtab, redis_vtbl_command *cmd, redis_reply_predicate_t expected);
+static int redis_vtbl_vtab_write_delete(redis_vtbl_vtab *vtab, sqlite3_int64 row_id);
+static int redis_vtbl_vtab_write_deletes(redis_vtbl_vtab *vtab);
+static int redis_vtbl_vtab_flush(redis_vtbl_vtab *vtab);
+static int redis_vtbl_vtab_truncate(redis_vtbl_vtab *vtab);
+static void redis_vtbl_vtab_discard(redis_vtbl_vtab *vtab);
 static void redis_vtbl_vtab_free(redis_vtbl_vtab *vtab);
+static void redis_vtbl_pending_free(redis_vtbl_pending *p);
+static void redis_vtbl_register_scripts(redis_vtbl_connection *conn);
 
-static int redis_vtbl_vtab_init(redis_vtbl_vtab *vtab, const char *conn_config, const char *db, const char *table, const char *prefix, char **pzErr) {
-    int err;
-    
+#define VTAB_ROWID_BLOCK_MAX 256
+
+/* Writes are flushed early once this many rows are buffered */
+#define VTAB_WRITES_MAX 16384
+/* Rows written by each evaluation of a write script */
+#define VTAB_BATCH_ROWS 256
+/* Rows or index values removed by each call of the truncate script */
+#define VTAB_TRUNCATE_CHUNK 1000
+/* Rows queued for the write behind thread before writers wait for it */
+#define VTAB_WRITE_BEHIND_MAX 65536
+
+static int redis_vtbl_vtab_init(redis_vtbl_vtab *vtab, const char *db, const char *table, const char *prefix) {
     memset(&vtab->base, 0, sizeof(sqlite3_vtab));
     
-    err = redis_vtbl_connection_init(&vtab->conn, conn_config);
-    if(err) {
-        switch(err) {
-            case CONNECTION_BAD_FORMAT:
-                *pzErr = sqlite3_mprintf("Bad format; Expected ip[:port] | sentinel service ip[:port] [ip[:port]...], key_prefix, column_def0, ...column_defN");
-                return SQLITE_ERROR;
-            case CONNECTION_ENOMEM:
-                return SQLITE_NOMEM;
-        }
-    }
-    
+    vtab->conn = 0;                 /* acquired once the table options are known */
     vtab->key_base = 0;
     
     string_append(&vtab->key_base, prefix);
@@ -196,16 +427,101 @@ static int redis_vtbl_vtab_init(redis_vtbl_vtab *vtab, const char *conn_config,
     string_append(&vtab->key_base, ".");
     string_append(&vtab->key_base, table);
     
-    if(!vtab->key_base) {
-        redis_vtbl_connection_free(&vtab->conn);
-        return SQLITE_NOMEM;
-    }
+    if(!vtab->key_base) return SQLITE_NOMEM;
     
     vector_init(&vtab->columns, sizeof(redis_vtbl_column_spec), (void(*)(void*))redis_vtbl_column_spec_free);
+    vtab->rowid_next = 1;
+    vtab->rowid_last = 0;
+    vtab->rowid_block = 1;
+    vtab->rowid_block_max = VTAB_ROWID_BLOCK_MAX;
+    vtab->rowid_time = 0;
+    
+    vector_init(&vtab->writes, sizeof(redis_vtbl_command), (void(*)(void*))redis_vtbl_command_free);
+    list_init(&vtab->writes_expected, 0);
+    vtab->writes_rows = 0;
+    vtab->batch_script = 0;
+    vtab->batch_rows = 0;
+    vector_init(&vtab->spilled, sizeof(redis_vtbl_pending), (void(*)(void*))redis_vtbl_pending_free);
+    vector_init(&vtab->deletes, sizeof(sqlite3_int64), 0);
+    vtab->unlink = 0;
+    vtab->write_behind = 0;
+    vtab->flusher = 0;
+    vtab->timeouts[0] = vtab->timeouts[1] = vtab->timeouts[2] = -1;
+    vtab->read_replicas = -1;
+    vtab->writing = 0;
+    vtab->written = 0;
     
     return SQLITE_OK;
 }
 
+/* Table options are given amongst the column definitions as name=value
+ * Returns -1 if the argument is not an option. */
+static int redis_vtbl_vtab_option(redis_vtbl_vtab *vtab, const char *option, char **pzErr) {
+    const char *value;
+    char *end;
+    size_t len;
+    
+    while(isspace(*option)) ++option;
+    for(len = 0; isalnum(option[len]) || option[len] == '_'; ++len);
+    if(len == 0 || option[len] != '=') return -1;
+    value = option + len + 1;
+    
+    if(len == 11 && !strncmp(option, "rowid_block", len)) {
+        errno = 0;
+        vtab->rowid_block_max = strtoll(value, &end, 10);
+        if(errno || end == value || *end || vtab->rowid_block_max < 1) {
+            *pzErr = sqlite3_mprintf("Bad option; Expected rowid_block=N where N > 0");
+            return SQLITE_ERROR;
+        }
+        return SQLITE_OK;
+    }
+    
+    if(len == 6 && !strncmp(option, "unlink", len)) {
+        if(strcmp(value, "0") && strcmp(value, "1")) {
+            *pzErr = sqlite3_mprintf("Bad option; Expected unlink=0|1");
+            return SQLITE_ERROR;
+        }
+        vtab->unlink = value[0] == '1';
+        return SQLITE_OK;
+    }
+    
+    if((len == 15 && !strncmp(option, "connect_timeout", len)) ||
+            (len == 15 && !strncmp(option, "command_timeout", len)) ||
+            (len == 14 && !strncmp(option, "retry_deadline", len))) {
+        long *ms;
+        ms = &vtab->timeouts[option[0] == 'r' ? 2 : option[2] == 'n' ? 0 : 1];
+        errno = 0;
+        *ms = strtol(value, &end, 10);
+        if(errno || end == value || *end || *ms < 0) {
+            *pzErr = sqlite3_mprintf("Bad option; Expected %.*s=N milliseconds", (int)len, option);
+            return SQLITE_ERROR;
+        }
+        return SQLITE_OK;
+    }
+    
+    if(len == 13 && !strncmp(option, "read_replicas", len)) {
+        errno = 0;
+        vtab->read_replicas = strtol(value, &end, 10);
+        if(errno || end == value || *end || vtab->read_replicas < 0) {
+            *pzErr = sqlite3_mprintf("Bad option; Expected read_replicas=N seconds of replication lag");
+            return SQLITE_ERROR;
+        }
+        return SQLITE_OK;
+    }
+    
+    if(len == 12 && !strncmp(option, "write_behind", len)) {
+        if(strcmp(value, "0") && strcmp(value, "1")) {
+            *pzErr = sqlite3_mprintf("Bad option; Expected write_behind=0|1");
+            return SQLITE_ERROR;
+        }
+        vtab->write_behind = value[0] == '1';
+        return SQLITE_OK;
+    }
+    
+    *pzErr = sqlite3_mprintf("Unknown option '%.*s'", (int)len, option);
+    return SQLITE_ERROR;
+}
+
 static int redis_vtbl_vtab_update_indices(redis_vtbl_vtab *vtab) {
     int err;
     redis_vtbl_command cmd;
@@ -218,7 +534,7 @@ static int redis_vtbl_vtab_update_indices(redis_vtbl_vtab *vtab) {
     /* retrieve indices from redis */
     redis_vtbl_command_init_arg(&cmd, "SMEMBERS");
     redis_vtbl_command_arg_fmt(&cmd, "%s.indices", vtab->key_base);
-    reply = redis_vtbl_connection_command(&vtab->conn, &cmd);
+    reply = redis_vtbl_connection_command(vtab->conn, &cmd);
     if(!reply) return 1;
     
     list_init(&indexes, free);
@@ -237,13 +553,41 @@ static int redis_vtbl_vtab_update_indices(redis_vtbl_vtab *vtab) {
     return 0;
 }
 
+/* Rowids are reserved from the shared sequence in blocks with INCRBY and handed
+ * out locally. The block doubles while inserts keep coming (up to rowid_block)
+ * and falls back to a single rowid once they stop. Unused rowids are lost. */
+/* Size of the next block to reserve */
+static long long redis_vtbl_vtab_rowid_block(redis_vtbl_vtab *vtab) {
+    time_t now;
+    
+    now = time(0);
+    if(vtab->rowid_time && now - vtab->rowid_time <= 1)
+        vtab->rowid_block *= 2;
+    else
+        vtab->rowid_block = 1;
+    if(vtab->rowid_block > vtab->rowid_block_max)
+        vtab->rowid_block = vtab->rowid_block_max;
+    vtab->rowid_time = now;
+    
+    return vtab->rowid_block;
+}
+
 static int redis_vtbl_vtab_generate_rowid(redis_vtbl_vtab *vtab, sqlite3_int64 *rowid) {
     redis_vtbl_command cmd;
     redisReply *reply;
+    long long n;
+    
+    if(vtab->rowid_next <= vtab->rowid_last) {
+        *rowid = vtab->rowid_next++;
+        return 0;
+    }
+    
+    n = redis_vtbl_vtab_rowid_block(vtab);
     
-    redis_vtbl_command_init_arg(&cmd, "INCR");
+    redis_vtbl_command_init_arg(&cmd, "INCRBY");
     redis_vtbl_command_arg_fmt(&cmd, "%s.rowid", vtab->key_base);
-    reply = redis_vtbl_connection_command(&vtab->conn, &cmd);
+    redis_vtbl_command_arg_fmt(&cmd, "%lld", n);
+    reply = redis_vtbl_connection_command(vtab->conn, &cmd);
     if(!reply) return 1;
     
     if(reply->type != REDIS_REPLY_INTEGER) {
@@ -251,15 +595,384 @@ static int redis_vtbl_vtab_generate_rowid(redis_vtbl_vtab *vtab, sqlite3_int64 *
         return 1;
     }
     
-    *rowid = reply->integer;
+    vtab->rowid_last = reply->integer;
+    vtab->rowid_next = reply->integer - n + 1;
     freeReplyObject(reply);
+    
+    *rowid = vtab->rowid_next++;
+    return 0;
+}
+
+/* Buffer a mutation; takes ownership of the cmd object.
+ * expected is the predicate for its reply within the EXEC result. */
+static void redis_vtbl_vtab_write(redis_vtbl_vtab *vtab, redis_vtbl_command *cmd, redis_reply_predicate_t expected) {
+    vector_push(&vtab->writes, cmd);
+    list_push(&vtab->writes_expected, expected);
+}
+
+static int redis_noscript_reply_p(redisReply *reply) {
+    return reply->type == REDIS_REPLY_ERROR && !strncmp(reply->str, "NOSCRIPT", 8);
+}
+
+/* Send the writes at the given positions as a single pipelined MULTI ... EXEC.
+ * Writes that failed because the server lost its script cache are added to noscript;
+ * they were not executed. */
+static int redis_vtbl_writes_exec(redis_vtbl_connection *conn, vector_t *writes, list_t *expected, vector_t *send, vector_t *noscript) {
+    int err;
+    redis_vtbl_command cmd;
+    list_t replies;
+    redisReply *reply;
+    redisReply *exec_reply;
+    redis_reply_predicate_t pred;
+    size_t i;
+    size_t *pos;
+    int aborted;
+    
+    redis_vtbl_command_init_arg(&cmd, "MULTI");
+    redis_vtbl_connection_command_enqueue(conn, &cmd);
+    
+    err = 0;
+    for(i = 0; i < send->size && !err; ++i) {
+        pos = vector_get(send, i);
+        err = redis_vtbl_command_copy(&cmd, vector_get(writes, *pos));
+        if(!err) redis_vtbl_connection_command_enqueue(conn, &cmd);
+    }
+    
+    redis_vtbl_command_init_arg(&cmd, err ? "DISCARD" : "EXEC");
+    redis_vtbl_connection_command_enqueue(conn, &cmd);
+    
+    list_init(&replies, freeReplyObject);
+    redis_vtbl_connection_read_queued(conn, &replies);
+    if(err || replies.size != send->size + 2 || !redis_status_reply_p(list_get(&replies, 0))) {
+        list_free(&replies);
+        return 1;
+    }
+    
+    err = 0;
+    aborted = 0;
+    for(i = 0; i < send->size; ++i) {
+        reply = list_get(&replies, i + 1);
+        if(redis_noscript_reply_p(reply))
+            aborted = 1;                    /* rejected when queued; EXEC discards the transaction */
+        else if(!redis_status_queued_reply_p(reply))
+            err = 1;
+    }
+    
+    exec_reply = list_get(&replies, replies.size-1);
+    if(err) {
+        /* failed */
+    } else if(aborted) {
+        for(i = 0; i < send->size; ++i)
+            vector_push(noscript, vector_get(send, i));
+    } else if(!redis_bulk_reply_p(exec_reply) || exec_reply->elements != send->size) {
+        err = 1;
+    } else {
+        for(i = 0; i < send->size; ++i) {
+            pos = vector_get(send, i);
+            reply = exec_reply->element[i];
+            pred = list_get(expected, *pos);
+            if(redis_noscript_reply_p(reply))
+                vector_push(noscript, pos);
+            else if(!pred(reply))
+                err = 1;
+        }
+    }
+    list_free(&replies);
+    
+    return err;
+}
+
+/* Send the writes. Every write script that failed with NOSCRIPT
+ * is sent once more, in order, after the scripts are loaded again. */
+static int redis_vtbl_writes_send(redis_vtbl_connection *conn, vector_t *writes, list_t *expected) {
+    int err;
+    vector_t send;
+    vector_t noscript;
+    size_t i;
+    
+    if(writes->size == 0) return 0;
+    
+    vector_init(&send, sizeof(size_t), 0);
+    vector_init(&noscript, sizeof(size_t), 0);
+    
+    for(i = 0; i < writes->size; ++i)
+        vector_push(&send, &i);
+    
+    err = redis_vtbl_writes_exec(conn, writes, expected, &send, &noscript);
+    if(!err && noscript.size) {
+#ifndef QUIET
+        fprintf(stderr, "redis_vtbl: script cache flushed; reloading\n");
+#endif
+        redis_vtbl_connection_load_scripts(conn);
+        vector_clear(&send);
+        err = redis_vtbl_writes_exec(conn, writes, expected, &noscript, &send);
+        if(send.size) err = 1;
+    }
+    
+    vector_free(&send);
+    vector_free(&noscript);
+    return err;
+}
+
+/* Write behind
+ * Committed writes are handed to a thread with its own connection which sends them
+ * while the statement carries on. Up to VTAB_WRITE_BEHIND_MAX rows may be queued;
+ * beyond that the writer waits for the thread. Reads wait until the queue is empty
+ * so a connection always sees its own writes; as the queue holds only this table's
+ * writes, every one of them was queued before the read and a read costs a full drain. A failed write is reported by the
+ * next flush or read on the table. */
+typedef struct redis_vtbl_flusher {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;                /* signalled whenever the queue or state changes */
+    redis_vtbl_connection conn;         /* used only by the thread */
+    vector_t pending;                   /* redis_vtbl_pending waiting for the thread */
+    size_t pending_rows;                /* rows queued or being sent */
+    int failed;                         /* writes were lost since last reported */
+    int stop;
+} redis_vtbl_flusher;
+
+static void redis_vtbl_pending_free(redis_vtbl_pending *p) {
+    vector_free(&p->writes);
+    list_free(&p->expected);
+}
+
+static void* redis_vtbl_flusher_main(void *arg) {
+    redis_vtbl_flusher *flusher;
+    vector_t batch;
+    redis_vtbl_pending *p;
+    size_t rows;
+    int err;
+    
+    flusher = arg;
+    
+    pthread_mutex_lock(&flusher->lock);
+    for(;;) {
+        while(flusher->pending.size == 0 && !flusher->stop)
+            pthread_cond_wait(&flusher->cond, &flusher->lock);
+        if(flusher->pending.size == 0) break;          /* stopped and drained */
+        
+        batch = flusher->pending;
+        vector_init(&flusher->pending, sizeof(redis_vtbl_pending), (void(*)(void*))redis_vtbl_pending_free);
+        pthread_mutex_unlock(&flusher->lock);
+        
+        err = 0;
+        rows = 0;
+        redis_vtbl_connection_watch(&flusher->conn);
+        for(p = vector_begin(&batch); p != vector_end(&batch); ++p) {
+            if(redis_vtbl_writes_send(&flusher->conn, &p->writes, &p->expected)) {
+#ifndef QUIET
+                fprintf(stderr, "redis_vtbl: write behind failed; %lu rows lost\n", (unsigned long)p->rows);
+#endif
+                err = 1;
+            }
+            rows += p->rows;
+        }
+        vector_free(&batch);
+        
+        pthread_mutex_lock(&flusher->lock);
+        flusher->pending_rows -= rows;
+        if(err) flusher->failed = 1;
+        pthread_cond_broadcast(&flusher->cond);
+    }
+    pthread_mutex_unlock(&flusher->lock);
+    return 0;
+}
+
+static int redis_vtbl_flusher_start(redis_vtbl_flusher **pFlusher, const char *conn_config, const long *timeouts, char **pzErr) {
+    redis_vtbl_flusher *flusher;
+    
+    flusher = malloc(sizeof(redis_vtbl_flusher));
+    if(!flusher) return SQLITE_NOMEM;
+    
+    if(redis_vtbl_connection_init(&flusher->conn, conn_config)) {
+        free(flusher);
+        return SQLITE_NOMEM;            /* config was validated by the table's own connection */
+    }
+    redis_vtbl_connection_timeouts(&flusher->conn, timeouts[0], timeouts[1], timeouts[2]);
+    redis_vtbl_register_scripts(&flusher->conn);
+    if(redis_vtbl_connection_connect(&flusher->conn)) {
+        *pzErr = sqlite3_mprintf("Write behind: %s", flusher->conn.errstr);
+        redis_vtbl_connection_free(&flusher->conn);
+        free(flusher);
+        return SQLITE_ERROR;
+    }
+    
+    vector_init(&flusher->pending, sizeof(redis_vtbl_pending), (void(*)(void*))redis_vtbl_pending_free);
+    flusher->pending_rows = 0;
+    flusher->failed = 0;
+    flusher->stop = 0;
+    pthread_mutex_init(&flusher->lock, 0);
+    pthread_cond_init(&flusher->cond, 0);
+    
+    if(pthread_create(&flusher->thread, 0, redis_vtbl_flusher_main, flusher)) {
+        pthread_cond_destroy(&flusher->cond);
+        pthread_mutex_destroy(&flusher->lock);
+        redis_vtbl_connection_free(&flusher->conn);
+        free(flusher);
+        *pzErr = sqlite3_mprintf("Write behind: unable to start thread");
+        return SQLITE_ERROR;
+    }
+    
+    *pFlusher = flusher;
+    return SQLITE_OK;
+}
+
+/* Returns nonzero if writes were lost since the last call; the caller holds the lock */
+static int redis_vtbl_flusher_failed(redis_vtbl_flusher *flusher) {
+    int failed;
+    failed = flusher->failed;
+    flusher->failed = 0;
+    return failed;
+}
+
+/* Queue the batch of writes, waiting for room if the queue is full.
+ * The queue takes over the contents of p unless this fails. */
+static int redis_vtbl_flusher_push(redis_vtbl_flusher *flusher, redis_vtbl_pending *p) {
+    int err;
+    
+    pthread_mutex_lock(&flusher->lock);
+    while(flusher->pending_rows && flusher->pending_rows + p->rows > VTAB_WRITE_BEHIND_MAX)
+        pthread_cond_wait(&flusher->cond, &flusher->lock);
+    
+    err = vector_push(&flusher->pending, p);
+    if(!err) {
+        flusher->pending_rows += p->rows;
+        pthread_cond_broadcast(&flusher->cond);
+    }
+    if(redis_vtbl_flusher_failed(flusher)) err = 1;
+    pthread_mutex_unlock(&flusher->lock);
+    return err ? 1 : 0;
+}
+
+/* Wait until every queued write has been sent */
+static int redis_vtbl_flusher_drain(redis_vtbl_flusher *flusher) {
+    int err;
+    
+    pthread_mutex_lock(&flusher->lock);
+    while(flusher->pending_rows)
+        pthread_cond_wait(&flusher->cond, &flusher->lock);
+    err = redis_vtbl_flusher_failed(flusher);
+    pthread_mutex_unlock(&flusher->lock);
+    return err;
+}
+
+/* Send everything still queued and stop the thread */
+static void redis_vtbl_flusher_stop(redis_vtbl_flusher *flusher) {
+    pthread_mutex_lock(&flusher->lock);
+    flusher->stop = 1;
+    pthread_cond_broadcast(&flusher->cond);
+    pthread_mutex_unlock(&flusher->lock);
+    pthread_join(flusher->thread, 0);
+    
+    pthread_cond_destroy(&flusher->cond);
+    pthread_mutex_destroy(&flusher->lock);
+    vector_free(&flusher->pending);
+    redis_vtbl_connection_free(&flusher->conn);
+    free(flusher);
+}
+
+/* Set the buffered writes aside as a batch, to be sent in turn by the next flush.
+ * Keeps the rows of a large transaction from being sent before it commits. */
+static int redis_vtbl_vtab_spill(redis_vtbl_vtab *vtab) {
+    redis_vtbl_pending p;
+    
+    p.writes = vtab->writes;
+    p.expected = vtab->writes_expected;
+    p.rows = vtab->writes_rows;
+    vector_init(&vtab->writes, sizeof(redis_vtbl_command), (void(*)(void*))redis_vtbl_command_free);
+    list_init(&vtab->writes_expected, 0);
+    vtab->writes_rows = 0;
+    vtab->batch_script = 0;
+    
+    if(vector_push(&vtab->spilled, &p)) {
+        redis_vtbl_pending_free(&p);
+        return 1;
+    }
     return 0;
 }
 
+/* Send the buffered writes, or with write_behind queue them for the flusher thread */
+static int redis_vtbl_vtab_flush_writes(redis_vtbl_vtab *vtab) {
+    int err;
+    redis_vtbl_pending *p;
+    
+    if(vtab->writes.size && redis_vtbl_vtab_spill(vtab)) err = 1;
+    else err = 0;
+    
+    for(p = vector_begin(&vtab->spilled); p != vector_end(&vtab->spilled) && !err; ++p) {
+        if(vtab->flusher) {
+            err = redis_vtbl_flusher_push(vtab->flusher, p);
+            if(!err) {
+                /* taken over by the queue */
+                vector_init(&p->writes, sizeof(redis_vtbl_command), (void(*)(void*))redis_vtbl_command_free);
+                list_init(&p->expected, 0);
+            }
+        } else {
+            err = redis_vtbl_writes_send(vtab->conn, &p->writes, &p->expected);
+        }
+    }
+    
+    vector_clear(&vtab->spilled);
+    return err ? 1 : 0;
+}
+
+/* Deletes are kept as bare rowids until some other write is buffered. If they account
+ * for every row in the table they are carried out by the truncate script; otherwise
+ * they are sent as individual delete scripts. */
+static int redis_vtbl_vtab_flush(redis_vtbl_vtab *vtab) {
+    int err;
+    size_t i;
+    sqlite3_int64 *row_id;
+    
+    if(vtab->deletes.size) {
+        if(vtab->flusher && redis_vtbl_flusher_drain(vtab->flusher)) {
+            redis_vtbl_vtab_discard(vtab);
+            return 1;
+        }
+        err = redis_vtbl_vtab_truncate(vtab);
+        if(err == 0) vector_clear(&vtab->deletes);
+        if(err > 0) {
+            redis_vtbl_vtab_discard(vtab);
+            return 1;
+        }
+        
+        err = 0;
+        for(i = 0; i < vtab->deletes.size && !err; ) {
+            for(; i < vtab->deletes.size && vtab->writes_rows < VTAB_WRITES_MAX && !err; ++i) {
+                row_id = vector_get(&vtab->deletes, i);
+                err = redis_vtbl_vtab_write_delete(vtab, *row_id);
+            }
+            if(!err) err = redis_vtbl_vtab_flush_writes(vtab);
+        }
+        if(err) {
+            redis_vtbl_vtab_discard(vtab);
+            return 1;
+        }
+        vector_clear(&vtab->deletes);
+    }
+    
+    return redis_vtbl_vtab_flush_writes(vtab);
+}
+
+static void redis_vtbl_vtab_discard(redis_vtbl_vtab *vtab) {
+    vector_clear(&vtab->writes);
+    list_clear(&vtab->writes_expected);
+    vtab->writes_rows = 0;
+    vtab->batch_script = 0;
+    vector_clear(&vtab->spilled);
+    vector_clear(&vtab->deletes);
+}
+
 static void redis_vtbl_vtab_free(redis_vtbl_vtab *vtab) {
-    redis_vtbl_connection_free(&vtab->conn);
+    if(vtab->conn) redis_vtbl_connection_release(vtab->conn);
     free(vtab->key_base);
     vector_free(&vtab->columns);
+    vector_free(&vtab->writes);
+    list_free(&vtab->writes_expected);
+    vector_free(&vtab->spilled);
+    vector_free(&vtab->deletes);
+    if(vtab->flusher) redis_vtbl_flusher_stop(vtab->flusher);
 }
 
 /* argv[1]    - database name
@@ -290,36 +1003,66 @@ static int redis_vtbl_create(sqlite3 *db, void *pAux, int argc, const char *cons
     
     vtab = malloc(sizeof(redis_vtbl_vtab));
     if(!vtab) return SQLITE_NOMEM;
+    vtab->db = db;
     
     /* Initialises structure parameters
      * Parses and validates configuration
      * returns an sqlite error code on failure */
-    err = redis_vtbl_vtab_init(vtab, conn_config, db_name, table, prefix, pzErr);
+    err = redis_vtbl_vtab_init(vtab, db_name, table, prefix);
     if(err) {
-        /* error message is already set */
         free(vtab);
         return err;
     }
     
-    /* Attempt to connect to redis.
+    list_init(&column, 0);
+    for(i = 5; i < argc; ++i) {
+        err = redis_vtbl_vtab_option(vtab, argv[i], pzErr);
+        if(err == -1) {
+            list_push(&column, (char*)argv[i]);
+        } else if(err) {
+            list_free(&column);
+            redis_vtbl_vtab_free(vtab);
+            free(vtab);
+            return SQLITE_ERROR;
+        }
+    }
+    
+    /* Tables of this database share the connection if their configuration and timeouts match */
+    err = redis_vtbl_connection_acquire(&vtab->conn, conn_config, vtab->db, vtab->timeouts[0], vtab->timeouts[1], vtab->timeouts[2]);
+    if(err) {
+        if(err == CONNECTION_BAD_FORMAT)
+            *pzErr = sqlite3_mprintf("Bad format; Expected ip[:port] | sentinel service ip[:port] [ip[:port]...], key_prefix, column_def0, ...column_defN");
+        list_free(&column);
+        redis_vtbl_vtab_free(vtab);
+        free(vtab);
+        return err == CONNECTION_ENOMEM ? SQLITE_NOMEM : SQLITE_ERROR;
+    }
+    redis_vtbl_register_scripts(vtab->conn);
+    
+    if(vtab->read_replicas >= 0 && !vtab->conn->service) {
+        *pzErr = sqlite3_mprintf("Bad option; read_replicas requires a sentinel connection");
+        list_free(&column);
+        redis_vtbl_vtab_free(vtab);
+        free(vtab);
+        return SQLITE_ERROR;
+    }
+    
+    /* Attempt to connect to redis unless another table of this database already has.
      * Will either connect via sentinel or directly to redis depending on the configuration. */
-    err = redis_vtbl_connection_connect(&vtab->conn);
+    err = vtab->conn->c ? 0 : redis_vtbl_connection_connect(vtab->conn);
     if(err) {
-        if(vtab->conn.service) {
-            *pzErr = sqlite3_mprintf("Sentinel: %s", vtab->conn.errstr);
+        if(vtab->conn->service) {
+            *pzErr = sqlite3_mprintf("Sentinel: %s", vtab->conn->errstr);
         } else {
-            *pzErr = sqlite3_mprintf("Redis: %s", vtab->conn.errstr);
+            *pzErr = sqlite3_mprintf("Redis: %s", vtab->conn->errstr);
         }
         
+        list_free(&column);
         redis_vtbl_vtab_free(vtab);
         free(vtab);
         return SQLITE_ERROR;
     }
     
-    list_init(&column, 0);
-    for(i = 5; i < argc; ++i)
-        list_push(&column, (char*)argv[i]);
-    
     /* parse column names and types */
     for(n = 0; n < column.size; ++n) {
         err = redis_vtbl_column_spec_init(&cspec, list_get(&column, n));
@@ -346,6 +1089,16 @@ static int redis_vtbl_create(sqlite3 *db, void *pAux, int argc, const char *cons
         return SQLITE_ERROR;
     }
     
+    if(vtab->write_behind) {
+        err = redis_vtbl_flusher_start(&vtab->flusher, conn_config, vtab->timeouts, pzErr);
+        if(err) {
+            list_free(&column);
+            redis_vtbl_vtab_free(vtab);
+            free(vtab);
+            return err;
+        }
+    }
+    
     /* Create table definition and pass to sqlite */
     char* s = 0;
     string_append(&s, "CREATE TABLE xxxx(");
@@ -372,81 +1125,275 @@ static int redis_vtbl_connect(sqlite3 *db, void *pAux, int argc, const char *con
     return redis_vtbl_create(db, pAux, argc, argv, ppVTab, pzErr);
 }
 
-static int redis_vtbl_bestindex(sqlite3_vtab *pVTab, sqlite3_index_info *pIndexInfo) {
-    redis_vtbl_vtab *vtab;
-    int i;
-    
+/* Constraint ops the filter script is able to evaluate */
+static const char* redis_vtbl_filter_op(int op) {
+    switch(op) {
+        case SQLITE_INDEX_CONSTRAINT_EQ: return "eq";
+        case SQLITE_INDEX_CONSTRAINT_NE: return "ne";
+        case SQLITE_INDEX_CONSTRAINT_GT: return "gt";
+        case SQLITE_INDEX_CONSTRAINT_GE: return "ge";
+        case SQLITE_INDEX_CONSTRAINT_LT: return "lt";
+        case SQLITE_INDEX_CONSTRAINT_LE: return "le";
+    }
+    return 0;
+}
+
+/* Access paths which page through the rowid index */
+static int redis_vtbl_scan_p(int idxNum) {
+    return idxNum == CURSOR_INDEX_SCAN || idxNum == CURSOR_INDEX_ORDERED ||
+        (idxNum >= CURSOR_INDEX_ROWID_GT && idxNum <= CURSOR_INDEX_ROWID_LE);
+}
+
+/* Indexed constraints that can be resolved to rowids by the lookup script.
+ * Numeric indexes are ranged by score, text indexes lexicographically. */
+static int redis_vtbl_lookup_p(redis_vtbl_column_spec *cspec, int op) {
+    if(!cspec->indexed || cspec->data_type == SQLITE_BLOB) return 0;
+    
+    switch(op) {
+        case SQLITE_INDEX_CONSTRAINT_EQ:
+        case SQLITE_INDEX_CONSTRAINT_GT:
+        case SQLITE_INDEX_CONSTRAINT_LE:
+        case SQLITE_INDEX_CONSTRAINT_LT:
+        case SQLITE_INDEX_CONSTRAINT_GE:
+            return 1;
+        case SQLITE_INDEX_CONSTRAINT_GLOB:          /* the literal prefix of the pattern */
+            return cspec->data_type == SQLITE_TEXT;
+    }
+    return 0;
+}
+
+/* Text is compared bytewise i.e. BINARY collation. The collation of a constraint can
+ * only be asked of sqlite 3.22 or later; loaded into an older sqlite, text constraints
+ * and ORDER BY are left to sqlite. An i of -1 (ORDER BY) checks only the version. */
+static int redis_vtbl_binary_p(sqlite3_index_info *pIndexInfo, int i) {
+#if SQLITE_VERSION_NUMBER >= 3022000
+    const char *collation;
+    
+    if(sqlite3_libversion_number() < 3022000) return 0;
+    if(i < 0) return 1;
+    collation = sqlite3_vtab_collation(pIndexInfo, i);
+    return !collation || !strcasecmp(collation, "BINARY");
+#else
+    (void)pIndexInfo;
+    (void)i;
+    return 0;
+#endif
+}
+
+static int redis_vtbl_bestindex(sqlite3_vtab *pVTab, sqlite3_index_info *pIndexInfo) {
+    redis_vtbl_vtab *vtab;
+    redis_vtbl_plan plan;
+    int i;
+    int argv_index;
+    int eq;
+    int inexact;
+    
     vtab = (redis_vtbl_vtab*)pVTab;
+    inexact = 0;                    /* a claimed constraint returns a superset of the matching rows */
+    
+    redis_vtbl_plan_init(&plan);
+    
+    /* Only the columns referenced by the statement are retrieved by the cursor */
+    plan.columns = pIndexInfo->colUsed;
     
     /* Explanation of cost constants
      * 10000.0  Guess at cost of full table scan
+     * 7500.0   Full table scan filtered by redis returns fewer rows
      * 1.0      Lookup by rowid is O(1)
      * 2500.0   Lookup by relative rowid is fairly cheap
+     * 2000.0   Lookup by relative rowid filtered by redis
      * 10.0     Lookup by index incurs some lookup overhead
-     * 5000.0   Lookup by relative index requires multiple ops */
+     * 5000.0   Lookup by relative index requires multiple ops
+     * Each additional index intersected reduces the rows returned */
     pIndexInfo->idxNum = CURSOR_INDEX_SCAN;
     pIndexInfo->estimatedCost = 10000.0;
     
+    /* Lookup by rowid */
     for(i = 0; i < pIndexInfo->nConstraint; ++i) {
         struct sqlite3_index_constraint *constraint = &pIndexInfo->aConstraint[i];
         if(!constraint->usable) continue;
         
-        if(constraint->iColumn == /* rowid */ -1) {
+        if(constraint->iColumn == /* rowid */ -1 && constraint->op == SQLITE_INDEX_CONSTRAINT_EQ) {
+            pIndexInfo->idxNum = CURSOR_INDEX_ROWID_EQ;
             pIndexInfo->aConstraintUsage[i].argvIndex = 1;
-            pIndexInfo->estimatedCost = constraint->op == SQLITE_INDEX_CONSTRAINT_EQ ? 1.0 : 2500.0;
-            
-            switch(constraint->op) {
-                case SQLITE_INDEX_CONSTRAINT_EQ:
-                    pIndexInfo->idxNum = CURSOR_INDEX_ROWID_EQ;
-                    break;
-                case SQLITE_INDEX_CONSTRAINT_GT:
-                    pIndexInfo->idxNum = CURSOR_INDEX_ROWID_GT;
-                    break;
-                case SQLITE_INDEX_CONSTRAINT_LE:
-                    pIndexInfo->idxNum = CURSOR_INDEX_ROWID_LE;
-                    break;
-                case SQLITE_INDEX_CONSTRAINT_LT:
-                    pIndexInfo->idxNum = CURSOR_INDEX_ROWID_LT;
-                    break;
-                case SQLITE_INDEX_CONSTRAINT_GE:
-                    pIndexInfo->idxNum = CURSOR_INDEX_ROWID_GE;
-                    break;
-            }
+            pIndexInfo->estimatedCost = 1.0;
             break;
-        } else {
+        }
+    }
+    
+    /* Intersection of every usable index */
+    if(pIndexInfo->idxNum == CURSOR_INDEX_SCAN) {
+        eq = 0;
+        for(i = 0; i < pIndexInfo->nConstraint; ++i) {
+            struct sqlite3_index_constraint *constraint = &pIndexInfo->aConstraint[i];
             redis_vtbl_column_spec *cspec;
-        
-            /* lookup the column by id
-             * Determine if that column is indexed */
+            redis_vtbl_plan_term term;
+            
+            if(!constraint->usable || constraint->iColumn < 0) continue;
+            
             cspec = vector_get(&vtab->columns, constraint->iColumn);
-            if(!cspec) return SQLITE_ERROR;
+            if(!cspec) {
+                redis_vtbl_plan_free(&plan);
+                return SQLITE_ERROR;
+            }
+            if(!redis_vtbl_lookup_p(cspec, constraint->op)) continue;
             
-            if(cspec->indexed) {
-                pIndexInfo->aConstraintUsage[i].argvIndex = 1;
-                pIndexInfo->estimatedCost = constraint->op == SQLITE_INDEX_CONSTRAINT_EQ ? 10.0 : 5000.0;
-                pIndexInfo->idxStr = cspec->name;
-                
-                switch(constraint->op) {
-                    case SQLITE_INDEX_CONSTRAINT_EQ:
-                        pIndexInfo->idxNum = CURSOR_INDEX_NAMED_EQ;
-                        break;
-                    case SQLITE_INDEX_CONSTRAINT_GT:
-                        pIndexInfo->idxNum = CURSOR_INDEX_NAMED_GT;
-                        break;
-                    case SQLITE_INDEX_CONSTRAINT_LE:
-                        pIndexInfo->idxNum = CURSOR_INDEX_NAMED_LE;
-                        break;
-                    case SQLITE_INDEX_CONSTRAINT_LT:
-                        pIndexInfo->idxNum = CURSOR_INDEX_NAMED_LT;
-                        break;
-                    case SQLITE_INDEX_CONSTRAINT_GE:
-                        pIndexInfo->idxNum = CURSOR_INDEX_NAMED_GE;
-                        break;
-                }
+            /* index members are matched bytewise */
+            if(cspec->data_type == SQLITE_TEXT && !redis_vtbl_binary_p(pIndexInfo, i)) continue;
+            
+            term.column = constraint->iColumn;
+            term.op = constraint->op;
+#if SQLITE_VERSION_NUMBER >= 3038000
+            /* Receive the whole IN list in a single xFilter call (sqlite 3.38 or later) */
+            if(constraint->op == SQLITE_INDEX_CONSTRAINT_EQ && sqlite3_libversion_number() >= 3038000 &&
+               sqlite3_vtab_in(pIndexInfo, i, -1)) {
+                sqlite3_vtab_in(pIndexInfo, i, 1);
+                term.op = PLAN_OP_IN;
+            }
+#endif
+            if(vector_push(&plan.lookup, &term)) {
+                redis_vtbl_plan_free(&plan);
+                return SQLITE_NOMEM;
+            }
+            pIndexInfo->aConstraintUsage[i].argvIndex = plan.lookup.size;
+            if(term.op == SQLITE_INDEX_CONSTRAINT_EQ || term.op == PLAN_OP_IN) ++eq;
+            if(term.op == SQLITE_INDEX_CONSTRAINT_GLOB) inexact = 1;
+        }
+        
+        if(plan.lookup.size) {
+            pIndexInfo->idxNum = CURSOR_INDEX_LOOKUP;
+            pIndexInfo->estimatedCost = (eq ? 10.0 : 5000.0) / plan.lookup.size;
+        }
+    }
+    
+    /* Lookup by relative rowid */
+    for(i = 0; i < pIndexInfo->nConstraint && pIndexInfo->idxNum == CURSOR_INDEX_SCAN; ++i) {
+        struct sqlite3_index_constraint *constraint = &pIndexInfo->aConstraint[i];
+        if(!constraint->usable || constraint->iColumn != /* rowid */ -1) continue;
+        
+        switch(constraint->op) {
+            case SQLITE_INDEX_CONSTRAINT_GT:
+                pIndexInfo->idxNum = CURSOR_INDEX_ROWID_GT;
+                break;
+            case SQLITE_INDEX_CONSTRAINT_LE:
+                pIndexInfo->idxNum = CURSOR_INDEX_ROWID_LE;
+                break;
+            case SQLITE_INDEX_CONSTRAINT_LT:
+                pIndexInfo->idxNum = CURSOR_INDEX_ROWID_LT;
                 break;
+            case SQLITE_INDEX_CONSTRAINT_GE:
+                pIndexInfo->idxNum = CURSOR_INDEX_ROWID_GE;
+                break;
+            default:
+                continue;
+        }
+        pIndexInfo->aConstraintUsage[i].argvIndex = 1;
+        pIndexInfo->estimatedCost = 2500.0;
+    }
+    
+    /* ORDER BY a single column.
+     * rowid order is the order of the rowid index; lookup results are sorted before they are returned.
+     * An indexed column is scanned by walking its index in order. */
+    if(pIndexInfo->nOrderBy == 1) {
+        struct sqlite3_index_orderby *order_by = &pIndexInfo->aOrderBy[0];
+        redis_vtbl_column_spec *cspec;
+        
+        if(pIndexInfo->idxNum == CURSOR_INDEX_ROWID_EQ) {
+            pIndexInfo->orderByConsumed = 1;            /* at most one row */
+        
+        } else if(order_by->iColumn == /* rowid */ -1) {
+            plan.order = order_by->desc ? -1 : 1;
+            pIndexInfo->orderByConsumed = 1;
+        
+        } else if(pIndexInfo->idxNum == CURSOR_INDEX_SCAN) {
+            cspec = vector_get(&vtab->columns, order_by->iColumn);
+            if(cspec && cspec->indexed && cspec->data_type != SQLITE_BLOB &&
+               (cspec->data_type != SQLITE_TEXT || redis_vtbl_binary_p(pIndexInfo, -1))) {
+                pIndexInfo->idxNum = CURSOR_INDEX_ORDERED;
+                plan.index = order_by->iColumn;
+                plan.order = order_by->desc ? -1 : 1;
+                pIndexInfo->orderByConsumed = 1;
+            }
+        }
+    }
+    
+    /* When paging through the rowid index the remaining constraints are
+     * evaluated by redis so only matching rowids are returned.
+     * sqlite still checks them; they are not omitted. */
+    if(redis_vtbl_scan_p(pIndexInfo->idxNum)) {
+        argv_index = (pIndexInfo->idxNum == CURSOR_INDEX_SCAN || pIndexInfo->idxNum == CURSOR_INDEX_ORDERED) ? 1 : 2;
+        
+        for(i = 0; i < pIndexInfo->nConstraint; ++i) {
+            struct sqlite3_index_constraint *constraint = &pIndexInfo->aConstraint[i];
+            redis_vtbl_column_spec *cspec;
+            redis_vtbl_plan_term term;
+            
+            if(!constraint->usable || constraint->iColumn < 0) continue;
+            if(pIndexInfo->aConstraintUsage[i].argvIndex) continue;
+            if(!redis_vtbl_filter_op(constraint->op)) continue;
+            
+            cspec = vector_get(&vtab->columns, constraint->iColumn);
+            if(!cspec || cspec->data_type == SQLITE_BLOB) continue;
+            
+            /* the filter compares text bytewise */
+            if(cspec->data_type == SQLITE_TEXT && !redis_vtbl_binary_p(pIndexInfo, i)) continue;
+            
+            /* lua's tonumber accepts float text strtod does not e.g. trailing space or
+             * out of range; the filter then matches rows xColumn returns as NULL */
+            if(cspec->data_type == SQLITE_FLOAT) inexact = 1;
+            
+            term.column = constraint->iColumn;
+            term.op = constraint->op;
+            if(vector_push(&plan.filter, &term)) {
+                redis_vtbl_plan_free(&plan);
+                return SQLITE_NOMEM;
+            }
+            pIndexInfo->aConstraintUsage[i].argvIndex = argv_index++;
+        }
+        
+        if(plan.filter.size)
+            pIndexInfo->estimatedCost = pIndexInfo->idxNum == CURSOR_INDEX_SCAN || pIndexInfo->idxNum == CURSOR_INDEX_ORDERED ? 7500.0 : 2000.0;
+    }
+    
+#if SQLITE_VERSION_NUMBER >= 3038000
+    /* LIMIT and OFFSET are applied by the cursor only if it returns exactly the rows sqlite would;
+     * every other constraint is evaluated by redis and any ORDER BY is consumed. */
+    if(!inexact && (pIndexInfo->nOrderBy == 0 || pIndexInfo->orderByConsumed)) {
+        int limit = -1;
+        int offset = -1;
+        int exact = 1;
+        
+        argv_index = 0;
+        for(i = 0; i < pIndexInfo->nConstraint; ++i) {
+            struct sqlite3_index_constraint *constraint = &pIndexInfo->aConstraint[i];
+            
+            if(constraint->op == SQLITE_INDEX_CONSTRAINT_LIMIT && constraint->usable)
+                limit = i;
+            else if(constraint->op == SQLITE_INDEX_CONSTRAINT_OFFSET && constraint->usable)
+                offset = i;
+            else if(!constraint->usable || !pIndexInfo->aConstraintUsage[i].argvIndex)
+                exact = 0;
+            
+            if(pIndexInfo->aConstraintUsage[i].argvIndex > argv_index)
+                argv_index = pIndexInfo->aConstraintUsage[i].argvIndex;
+        }
+        
+        if(exact && limit >= 0) {
+            pIndexInfo->aConstraintUsage[limit].argvIndex = ++argv_index;
+            plan.limit = argv_index - 1;
+            if(offset >= 0) {
+                pIndexInfo->aConstraintUsage[offset].argvIndex = ++argv_index;
+                pIndexInfo->aConstraintUsage[offset].omit = 1;      /* rows are skipped by redis */
+                plan.offset = argv_index - 1;
             }
         }
     }
+#endif
+    
+    pIndexInfo->idxStr = redis_vtbl_plan_format(&plan);
+    redis_vtbl_plan_free(&plan);
+    if(!pIndexInfo->idxStr) return SQLITE_NOMEM;
+    pIndexInfo->needToFreeIdxStr = 1;
     
     return SQLITE_OK;
 }
@@ -461,8 +1408,10 @@ static int redis_vtbl_findfunction(sqlite3_vtab *pVtab, int nArg, const char *zN
         return 1;
     }
     
-    /* todo overload other functions to improve performance.
-     * min and max are simple examples that atm require a table scan. */
+    /* Aggregates cannot be overloaded here. count(*) is answered by ZCARD
+     * (see redis_vtbl_cursor_filter_count); max(x) and min/max(rowid) are planned
+     * by sqlite as an ORDER BY consumed from the index, stopping after the first row.
+     * min(x) is not offered to virtual tables that way and still requires a scan. */
     
     return 0;
 }
@@ -494,18 +1443,203 @@ static int redis_vtbl_update(sqlite3_vtab *pVTab, int argc, sqlite3_value **argv
         return SQLITE_ERROR;        /* attempt to update rowid disallowed */
     }
     
+    /* kept until the transaction commits */
+    if(!err && vtab->writes_rows >= VTAB_WRITES_MAX && redis_vtbl_vtab_spill(vtab))
+        return SQLITE_NOMEM;
+    
     return err;
 }
 
+/* Row maintenance shared by the write scripts.
+ * write(key_base, row_id, first, last) stores the row from the column, value, score, member
+ *      arguments at ARGV[first..last] and adds it to the indexes; score is empty for unindexed columns
+ * unindex(key_base, row_id[, first, last]) removes the stored row from the indexes on the table;
+ *      only those on the columns named at ARGV[first..last] if given */
+#define REDIS_VTBL_LUA_ROW "\
+    local function write(key_base, row_id, first, last)\n\
+        local row = {};\n\
+        for i = first, last, 4 do\n\
+            row[#row+1] = ARGV[i];\n\
+            row[#row+1] = ARGV[i+1];\n\
+        end\n\
+        if #row == 0 then return end\n\
+        redis.call('HMSET', key_base..':'..row_id, unpack(row));\n\
+        for i = first, last, 4 do\n\
+            if ARGV[i+2] ~= '' then\n\
+                local index = key_base..'.index:'..ARGV[i];\n\
+                redis.call('ZADD', index, ARGV[i+2], ARGV[i+3]);\n\
+                redis.call('SADD', index..':'..ARGV[i+1], row_id);\n\
+            end\n\
+        end\n\
+    end\n\
+    \n\
+    local function unindex(key_base, row_id, first, last)\n\
+        local indexed_columns = redis.call('SMEMBERS', key_base..'.indices');\n\
+        if first then\n\
+            local changed, columns = {}, {};\n\
+            for i = first, last, 4 do changed[ARGV[i]] = true end\n\
+            for _,column_name in ipairs(indexed_columns) do\n\
+                if changed[column_name] then columns[#columns+1] = column_name end\n\
+            end\n\
+            indexed_columns = columns;\n\
+        end\n\
+        for _,column_name in ipairs(indexed_columns) do\n\
+            local column_value = redis.call('HGET', key_base..':'..row_id, column_name);\n\
+            if column_value then\n\
+                local value_index = key_base..'.index:'..column_name..':'..column_value;\n\
+                redis.call('SREM', value_index, row_id);\n\
+                if(redis.call('EXISTS', value_index) == 0) then\n\
+                    redis.call('ZREM', key_base..'.index:'..column_name, column_value);\n\
+                end\n\
+            end\n\
+        end\n\
+    end\n\
+"
+
+/* ARGV[1]  key_base
+ * ARGV[2]  arguments per row
+ * ARGV[3]  rowids to reserve for a row given rowid 0
+ * ARGV[4...] rowid followed by column, value, score, member for each column, for each row
+ * Returns the rowid of the last row. */
+static const char redis_vtbl_script_insert[] = REDIS_VTBL_LUA_ROW "\
+    local key_base, width, n = ARGV[1], tonumber(ARGV[2]), tonumber(ARGV[3]);\n\
+    local row_id;\n\
+    for r = 4, #ARGV, width do\n\
+        row_id = ARGV[r];\n\
+        if row_id == '0' then\n\
+            row_id = redis.call('INCRBY', key_base..'.rowid', n) - n + 1;\n\
+        end\n\
+        write(key_base, row_id, r + 1, r + width - 1);\n\
+        redis.call('ZADD', key_base..'.index.rowid', row_id, row_id);\n\
+    end\n\
+    redis.call('INCR', key_base..'.generation');\n\
+    return tonumber(row_id);\n";
+
+/* ARGV[1]  key_base
+ * ARGV[2...] rowid, n followed by column, value, score, member for each of the n changed columns, for each row
+ * Returns the number of rows. */
+static const char redis_vtbl_script_update[] = REDIS_VTBL_LUA_ROW "\
+    local key_base = ARGV[1];\n\
+    local r, rows = 2, 0;\n\
+    while r <= #ARGV do\n\
+        local row_id, last = ARGV[r], r + 1 + 4 * tonumber(ARGV[r+1]);\n\
+        unindex(key_base, row_id, r + 2, last);\n\
+        write(key_base, row_id, r + 2, last);\n\
+        r, rows = last + 1, rows + 1;\n\
+    end\n\
+    return rows;\n";
+
+/* ARGV[1]  key_base
+ * ARGV[2...] rowids
+ * Returns the number of rows. */
+static const char redis_vtbl_script_delete[] = REDIS_VTBL_LUA_ROW "\
+    local key_base = ARGV[1];\n\
+    for r = 2, #ARGV do\n\
+        unindex(key_base, ARGV[r]);\n\
+        redis.call('DEL', key_base..':'..ARGV[r]);\n\
+        redis.call('ZREM', key_base..'.index.rowid', ARGV[r]);\n\
+    end\n\
+    redis.call('INCR', key_base..'.generation');\n\
+    return #ARGV - 1;\n";
+
+/* The buffered evaluation of a write script to which the caller appends the arguments
+ * of one row. Consecutive rows for the same script share an evaluation of up to
+ * VTAB_BATCH_ROWS rows. head holds the arguments preceding the rows; it is freed.
+ * Returns 0 on failure. */
+static redis_vtbl_command* redis_vtbl_vtab_write_batch(redis_vtbl_vtab *vtab, const char *script, redis_vtbl_command *head) {
+    redis_vtbl_command eval;
+    const char *sha;
+    
+    if(vtab->batch_script != script || vtab->batch_rows >= VTAB_BATCH_ROWS || vtab->writes.size == 0) {
+        sha = redis_vtbl_connection_script_sha(vtab->conn, script);
+        if(!sha) {
+            redis_vtbl_command_free(head);
+            return 0;
+        }
+        
+        redis_vtbl_command_init_arg(&eval, "EVALSHA");
+        redis_vtbl_command_arg(&eval, sha);
+        redis_vtbl_command_arg(&eval, "0");
+        redis_vtbl_command_args(&eval, head);
+        
+        redis_vtbl_vtab_write(vtab, &eval, redis_integer_reply_p);
+        vtab->batch_script = script;
+        vtab->batch_rows = 0;
+    }
+    redis_vtbl_command_free(head);
+    
+    ++vtab->batch_rows;
+    ++vtab->writes_rows;
+    return vector_get(&vtab->writes, vtab->writes.size - 1);
+}
+
+/* column, value, score, member arguments of the write scripts.
+ * Values are passed with their length so BLOB columns are binary safe.
+ * When ref is set the value is referenced rather than copied; the command
+ * must then be sent before the statement moves on from value. */
+static void redis_vtbl_column_args(redis_vtbl_column_spec *cspec, redis_vtbl_command *cmd, sqlite3_value *value, int ref) {
+    const char *text;
+    int bytes;
+    
+    if(cspec->data_type == SQLITE_BLOB)
+        text = sqlite3_value_blob(value);
+    else
+        text = (const char*)sqlite3_value_text(value);
+    bytes = sqlite3_value_bytes(value);
+    if(!text) {
+        text = "";
+        bytes = 0;
+    }
+    
+    redis_vtbl_command_arg(cmd, cspec->name);
+    if(ref)
+        redis_vtbl_command_arg_ref(cmd, text, bytes);
+    else
+        redis_vtbl_command_arg_len(cmd, text, bytes);
+    if(!cspec->indexed || cspec->data_type == SQLITE_BLOB) {
+        redis_vtbl_command_arg(cmd, "");
+        redis_vtbl_command_arg(cmd, "");
+    } else if(cspec->data_type == SQLITE_INTEGER || cspec->data_type == SQLITE_FLOAT) {
+        /* no affinity is applied; the member is the stored text so it matches the value
+         * set key e.g. '007' scores 7 */
+        if(cspec->data_type == SQLITE_INTEGER)
+            redis_vtbl_command_arg_fmt(cmd, "%lld", sqlite3_value_int64(value));
+        else
+            redis_vtbl_command_arg_fmt(cmd, "%.17g", sqlite3_value_double(value));
+        redis_vtbl_command_arg_len(cmd, text, bytes);
+    } else {
+        redis_vtbl_command_arg(cmd, "0");
+        redis_vtbl_command_arg_len(cmd, text, bytes);
+    }
+}
+
+static void redis_vtbl_insert_args(redis_vtbl_vtab *vtab, redis_vtbl_command *cmd, sqlite3_value **argv, int ref) {
+    size_t i;
+    
+    for(i = 0; i < vtab->columns.size; ++i)
+        redis_vtbl_column_args(vector_get(&vtab->columns, i), cmd, argv[i], ref);
+}
+
+/* Columns left unchanged by an UPDATE are neither read (see xColumn) nor written */
+static int redis_vtbl_value_changed_p(sqlite3_value *value) {
+#if SQLITE_VERSION_NUMBER >= 3022000
+    return sqlite3_libversion_number() < 3022000 || !sqlite3_value_nochange(value);
+#else
+    (void)value;
+    return 1;
+#endif
+}
+
+/* An autocommit insert that has no reserved rowid left is sent at once; the script
+ * reserves the next block so the whole insert is a single round trip. Otherwise the
+ * insert joins the writes buffered for the transaction. */
 static int redis_vtbl_exec_insert(redis_vtbl_vtab *vtab, int argc, sqlite3_value **argv, sqlite3_int64 *pRowid) {
     int err;
     sqlite3_int64 row_id;
     redis_vtbl_command cmd;
-    size_t i;
-    redis_vtbl_column_spec *cspec;
-    list_t replies;
-    list_t expected;
-    list_t expected_exec;
+    redis_vtbl_command *batch;
+    redisReply *reply;
+    long long n;
     
     if(sqlite3_value_type(argv[1]) != SQLITE_NULL) {
         vtab->base.zErrMsg = sqlite3_mprintf("User provided rowid disallowed.");
@@ -516,6 +1650,35 @@ static int redis_vtbl_exec_insert(redis_vtbl_vtab *vtab, int argc, sqlite3_value
         return SQLITE_ERROR;            /* correct number of columns not provided */
     }
     
+    if(vtab->rowid_next > vtab->rowid_last && vtab->writes.size == 0 && vtab->spilled.size == 0 && vtab->deletes.size == 0 && !vtab->flusher && sqlite3_get_autocommit(vtab->db)) {
+        n = redis_vtbl_vtab_rowid_block(vtab);
+        
+        redis_vtbl_command_init_arg(&cmd, "0");
+        redis_vtbl_command_arg(&cmd, vtab->key_base);
+        redis_vtbl_command_arg_fmt(&cmd, "%u", (unsigned)(1 + 4 * vtab->columns.size));
+        redis_vtbl_command_arg_fmt(&cmd, "%lld", n);
+        redis_vtbl_command_arg(&cmd, "0");
+        redis_vtbl_insert_args(vtab, &cmd, argv + 2, 1);   /* sent before returning */
+        reply = redis_vtbl_connection_eval(vtab->conn, redis_vtbl_script_insert, &cmd);
+        if(!reply) return SQLITE_ERROR;
+        
+        if(reply->type != REDIS_REPLY_INTEGER) {
+#ifndef QUIET
+            if(reply->type == REDIS_REPLY_ERROR) fprintf(stderr, "-ERR %s\n", reply->str);
+#endif
+            freeReplyObject(reply);
+            return SQLITE_ERROR;
+        }
+        
+        row_id = reply->integer;
+        freeReplyObject(reply);
+        
+        vtab->rowid_next = row_id + 1;
+        vtab->rowid_last = row_id + n - 1;
+        *pRowid = row_id;
+        return SQLITE_OK;
+    }
+    
     err = redis_vtbl_vtab_generate_rowid(vtab, &row_id);
     if(err) {
         vtab->base.zErrMsg = sqlite3_mprintf("Unable to generate new rowid");
@@ -523,327 +1686,298 @@ static int redis_vtbl_exec_insert(redis_vtbl_vtab *vtab, int argc, sqlite3_value
     }
     *pRowid = row_id;
     
-    list_init(&expected, 0);
-    list_init(&expected_exec, 0);
-    
-    redis_vtbl_command_init_arg(&cmd, "MULTI");
-    redis_vtbl_connection_command_enqueue(&vtab->conn, &cmd);
-    list_push(&expected, redis_status_reply_p);
-    
-    /* HMSET key column0 value0 ...columnN valueN */                                                    /* create object */
-    redis_vtbl_command_init_arg(&cmd, "HMSET");
-    redis_vtbl_command_arg_fmt(&cmd, "%s:%lld", vtab->key_base, row_id);
-    for(i = 0; i < vtab->columns.size; ++i) {
-        cspec = vector_get(&vtab->columns, i);
-        redis_vtbl_command_arg(&cmd, cspec->name);
-        redis_vtbl_command_arg(&cmd, (const char*)sqlite3_value_text(argv[2 + i]));
-    }
-    redis_vtbl_connection_command_enqueue(&vtab->conn, &cmd);
-    list_push(&expected, redis_status_queued_reply_p);
-    list_push(&expected_exec, redis_status_reply_p);
-
-    redis_vtbl_command_init_arg(&cmd, "ZADD");                                                          /* add to rowids */
-    redis_vtbl_command_arg_fmt(&cmd, "%s.index.rowid", vtab->key_base);
-    redis_vtbl_command_arg_fmt(&cmd, "%lld", row_id);
-    redis_vtbl_command_arg_fmt(&cmd, "%lld", row_id);
-    redis_vtbl_connection_command_enqueue(&vtab->conn, &cmd);
-    list_push(&expected, redis_status_queued_reply_p);
-    list_push(&expected_exec, redis_integer_reply_p);
-    
-    for(i = 0; i < vtab->columns.size; ++i) {                                                           /* add to indexes */
-        cspec = vector_get(&vtab->columns, i);
-        if(!cspec->indexed) continue;
-        
-        if(cspec->data_type == SQLITE_INTEGER) {
-            sqlite3_int64 value;
-            value = sqlite3_value_int64(argv[2 + i]);
-            
-            redis_vtbl_command_init_arg(&cmd, "ZADD");
-            redis_vtbl_command_arg_fmt(&cmd, "%s.index:%s", vtab->key_base, cspec->name);
-            redis_vtbl_command_arg_fmt(&cmd, "%lld", value);
-            redis_vtbl_command_arg_fmt(&cmd, "%lld", value);
-            redis_vtbl_connection_command_enqueue(&vtab->conn, &cmd);
-            list_push(&expected, redis_status_queued_reply_p);
-            list_push(&expected_exec, redis_integer_reply_p);
-        } else if(cspec->data_type == SQLITE_FLOAT) {
-            double value;
-            value = sqlite3_value_double(argv[2 + i]);
-
-            redis_vtbl_command_init_arg(&cmd, "ZADD");
-            redis_vtbl_command_arg_fmt(&cmd, "%s.index:%s", vtab->key_base, cspec->name);
-            redis_vtbl_command_arg_fmt(&cmd, "%f", value);
-            redis_vtbl_command_arg_fmt(&cmd, "%f", value);
-            redis_vtbl_connection_command_enqueue(&vtab->conn, &cmd);
-            list_push(&expected, redis_status_queued_reply_p);
-            list_push(&expected_exec, redis_integer_reply_p);
-        } else {
-            const char *value;
-            value = (const char*)sqlite3_value_text(argv[2 + i]);
-            
-            redis_vtbl_command_init_arg(&cmd, "ZADD");
-            redis_vtbl_command_arg_fmt(&cmd, "%s.index:%s", vtab->key_base, cspec->name);
-            redis_vtbl_command_arg(&cmd, "0");
-            redis_vtbl_command_arg_fmt(&cmd, "%s", value);
-            redis_vtbl_connection_command_enqueue(&vtab->conn, &cmd);
-            list_push(&expected, redis_status_queued_reply_p);
-            list_push(&expected_exec, redis_integer_reply_p);
-        }
-        
-        redis_vtbl_command_init_arg(&cmd, "SADD");
-        redis_vtbl_command_arg_fmt(&cmd, "%s.index:%s:%s", vtab->key_base, cspec->name, (const char*)sqlite3_value_text(argv[2 + i]));
-        redis_vtbl_command_arg_fmt(&cmd, "%lld", row_id);
-        redis_vtbl_connection_command_enqueue(&vtab->conn, &cmd);
-        list_push(&expected, redis_status_queued_reply_p);
-        list_push(&expected_exec, redis_integer_reply_p);
-    }
-    
-    redis_vtbl_command_init_arg(&cmd, "EXEC");
-    redis_vtbl_connection_command_enqueue(&vtab->conn, &cmd);
-    list_push(&expected, redis_bulk_reply_p);
+    if(redis_vtbl_vtab_write_deletes(vtab)) return SQLITE_ERROR;
     
-    list_init(&replies, freeReplyObject);
-    redis_vtbl_connection_read_queued(&vtab->conn, &replies);
-    
-    err = redis_check_expected_list(&replies, &expected);
-    list_free(&expected);
+    redis_vtbl_command_init_arg(&cmd, vtab->key_base);
+    redis_vtbl_command_arg_fmt(&cmd, "%u", (unsigned)(1 + 4 * vtab->columns.size));
+    redis_vtbl_command_arg(&cmd, "1");
+    batch = redis_vtbl_vtab_write_batch(vtab, redis_vtbl_script_insert, &cmd);
+    if(!batch) return SQLITE_ERROR;
     
-    if(err) {
-        list_free(&replies);
-        list_free(&expected_exec);
-        return SQLITE_ERROR;
-    
-    } else {
-        redisReply *exec_reply;
-        exec_reply = list_get(&replies, replies.size-1);
-        err = redis_check_expected_bulk_list(exec_reply, &expected_exec);
-        list_free(&expected_exec);
-        if(err) {
-            list_free(&replies);
-            return SQLITE_ERROR;
-        }
-    }
-    list_free(&replies);
-
+    redis_vtbl_command_arg_fmt(batch, "%lld", row_id);
+    redis_vtbl_insert_args(vtab, batch, argv + 2, 0);
     return SQLITE_OK;
 }
 static int redis_vtbl_exec_update(redis_vtbl_vtab *vtab, int argc, sqlite3_value **argv) {
-    int err;
     sqlite3_int64 row_id;
     redis_vtbl_command cmd;
+    redis_vtbl_command *batch;
     size_t i;
-    redis_vtbl_column_spec *cspec;
-    list_t replies;
-    list_t expected;
-    list_t expected_exec;
+    unsigned n;
     
     if((unsigned)argc != vtab->columns.size + 2) {
         return SQLITE_ERROR;            /* correct number of columns not provided */
     }
     
-    list_init(&expected, 0);
-    list_init(&expected_exec, 0);
+    for(n = 0, i = 0; i < vtab->columns.size; ++i)
+        n += redis_vtbl_value_changed_p(argv[2 + i]);
+    if(n == 0) return SQLITE_OK;
     
-    row_id = sqlite3_value_int64(argv[0]);
-    redis_vtbl_command_init_arg(&cmd, "WATCH");                                                         /* WATCH key */
-    redis_vtbl_command_arg_fmt(&cmd, "%s:%lld", vtab->key_base, row_id);
-    redis_vtbl_connection_command_enqueue(&vtab->conn, &cmd);
-    list_push(&expected, redis_status_reply_p);
+    if(redis_vtbl_vtab_write_deletes(vtab)) return SQLITE_ERROR;
     
-    redis_vtbl_command_init_arg(&cmd, "MULTI");
-    redis_vtbl_connection_command_enqueue(&vtab->conn, &cmd);
-    list_push(&expected, redis_status_reply_p);
-    
-    redis_vtbl_command_init_arg(&cmd, "EVAL");                                                          /* update indexes (a) */
-    redis_vtbl_command_arg(&cmd, "\
-        local key_base = ARGV[1];\n\
-        local row_id = ARGV[2];\n\
-        \n\
-        local indexed_columns = redis.call('SMEMBERS', key_base..'.indices');\n\
-        for _,column_name in ipairs(indexed_columns) do\n\
-            local column_value = redis.call('HGET', key_base..':'..row_id, column_name);\n\
-            local value_index = key_base..'.index:'..column_name..':'..column_value;\n\
-            redis.call('SREM', value_index, row_id);\n\
-            if(redis.call('EXISTS', value_index) == 0) then\n\
-                redis.call('ZREM', key_base..'.index:'..column_name, column_value);\n\
-            end\n\
-        end\n\
-        return 1;\n");
-    redis_vtbl_command_arg(&cmd, "2");
-    redis_vtbl_command_arg_fmt(&cmd, "%s.indices", vtab->key_base);
-    redis_vtbl_command_arg_fmt(&cmd, "%s:%lld", vtab->key_base, row_id);
-    redis_vtbl_command_arg(&cmd, vtab->key_base);
-    redis_vtbl_command_arg_fmt(&cmd, "%lld", row_id);
-    redis_vtbl_connection_command_enqueue(&vtab->conn, &cmd);
-    list_push(&expected, redis_status_queued_reply_p);
-    list_push(&expected_exec, redis_integer_reply_p);
-    
-    /* HMSET key column0 value0 ...columnN valueN */                                                    /* update object */
-    redis_vtbl_command_init_arg(&cmd, "HMSET");
-    redis_vtbl_command_arg_fmt(&cmd, "%s:%lld", vtab->key_base, row_id);
+    redis_vtbl_command_init_arg(&cmd, vtab->key_base);
+    batch = redis_vtbl_vtab_write_batch(vtab, redis_vtbl_script_update, &cmd);
+    if(!batch) return SQLITE_ERROR;
     
+    row_id = sqlite3_value_int64(argv[0]);
+    redis_vtbl_command_arg_fmt(batch, "%lld", row_id);
+    redis_vtbl_command_arg_fmt(batch, "%u", n);
     for(i = 0; i < vtab->columns.size; ++i) {
-        cspec = vector_get(&vtab->columns, i);
-        redis_vtbl_command_arg(&cmd, cspec->name);
-        redis_vtbl_command_arg(&cmd, (const char*)sqlite3_value_text(argv[2 + i]));
+        if(redis_vtbl_value_changed_p(argv[2 + i]))
+            redis_vtbl_column_args(vector_get(&vtab->columns, i), batch, argv[2 + i], 0);
     }
-    redis_vtbl_connection_command_enqueue(&vtab->conn, &cmd);
-    list_push(&expected, redis_status_queued_reply_p);
-    list_push(&expected_exec, redis_status_reply_p);
-    
-    for(i = 0; i < vtab->columns.size; ++i) {                                                           /* update indexes (b) */
-        cspec = vector_get(&vtab->columns, i);
-        if(!cspec->indexed) continue;
-        
-        if(cspec->data_type == SQLITE_INTEGER) {
-            sqlite3_int64 value;
-            value = sqlite3_value_int64(argv[2 + i]);
-            
-            redis_vtbl_command_init_arg(&cmd, "ZADD");
-            redis_vtbl_command_arg_fmt(&cmd, "%s.index:%s", vtab->key_base, cspec->name);
-            redis_vtbl_command_arg_fmt(&cmd, "%lld", value);
-            redis_vtbl_command_arg_fmt(&cmd, "%lld", value);
-            redis_vtbl_connection_command_enqueue(&vtab->conn, &cmd);
-            list_push(&expected, redis_status_queued_reply_p);
-            list_push(&expected_exec, redis_integer_reply_p);
-        } else if(cspec->data_type == SQLITE_FLOAT) {
-            double value;
-            value = sqlite3_value_double(argv[2 + i]);
-
-            redis_vtbl_command_init_arg(&cmd, "ZADD");
-            redis_vtbl_command_arg_fmt(&cmd, "%s.index:%s", vtab->key_base, cspec->name);
-            redis_vtbl_command_arg_fmt(&cmd, "%f", value);
-            redis_vtbl_command_arg_fmt(&cmd, "%f", value);
-            redis_vtbl_connection_command_enqueue(&vtab->conn, &cmd);
-            list_push(&expected, redis_status_queued_reply_p);
-            list_push(&expected_exec, redis_integer_reply_p);
-        } else {
-            const char *value;
-            value = (const char*)sqlite3_value_text(argv[2 + i]);
-            
-            redis_vtbl_command_init_arg(&cmd, "ZADD");
-            redis_vtbl_command_arg_fmt(&cmd, "%s.index:%s", vtab->key_base, cspec->name);
-            redis_vtbl_command_arg(&cmd, "0");
-            redis_vtbl_command_arg_fmt(&cmd, "%s", value);
-            redis_vtbl_connection_command_enqueue(&vtab->conn, &cmd);
-            list_push(&expected, redis_status_queued_reply_p);
-            list_push(&expected_exec, redis_integer_reply_p);
-        }
-        
-        redis_vtbl_command_init_arg(&cmd, "SADD");
-        redis_vtbl_command_arg_fmt(&cmd, "%s.index:%s:%s", vtab->key_base, cspec->name, (const char*)sqlite3_value_text(argv[2 + i]));
-        redis_vtbl_command_arg_fmt(&cmd, "%lld", row_id);
-        redis_vtbl_connection_command_enqueue(&vtab->conn, &cmd);
-        list_push(&expected, redis_status_queued_reply_p);
-        list_push(&expected_exec, redis_integer_reply_p);
-    }
-    
-    redis_vtbl_command_init_arg(&cmd, "EXEC");
-    redis_vtbl_connection_command_enqueue(&vtab->conn, &cmd);
-    list_push(&expected, redis_bulk_reply_p);
+    return SQLITE_OK;
+}
+static int redis_vtbl_exec_delete(redis_vtbl_vtab *vtab, sqlite3_int64 row_id) {
+    if(vtab->writes.size || vtab->spilled.size) return redis_vtbl_vtab_write_delete(vtab, row_id);
     
-    list_init(&replies, freeReplyObject);
-    redis_vtbl_connection_read_queued(&vtab->conn, &replies);
+    if(vector_push(&vtab->deletes, &row_id)) return SQLITE_NOMEM;
+    return SQLITE_OK;
+}
+
+static int redis_vtbl_vtab_write_delete(redis_vtbl_vtab *vtab, sqlite3_int64 row_id) {
+    redis_vtbl_command cmd;
+    redis_vtbl_command *batch;
     
-    err = redis_check_expected_list(&replies, &expected);
-    list_free(&expected);
+    redis_vtbl_command_init_arg(&cmd, vtab->key_base);
+    batch = redis_vtbl_vtab_write_batch(vtab, redis_vtbl_script_delete, &cmd);
+    if(!batch) return SQLITE_ERROR;
     
-    if(err) {
-        list_free(&replies);
-        list_free(&expected_exec);
-        return SQLITE_ERROR;
+    redis_vtbl_command_arg_fmt(batch, "%lld", row_id);
+    return SQLITE_OK;
+}
+
+/* Buffered deletes must reach redis ahead of any write that follows them */
+static int redis_vtbl_vtab_write_deletes(redis_vtbl_vtab *vtab) {
+    size_t i;
+    sqlite3_int64 *row_id;
     
-    } else {
-        redisReply *exec_reply;
-        exec_reply = list_get(&replies, replies.size-1);
-        err = redis_check_expected_bulk_list(exec_reply, &expected_exec);
-        list_free(&expected_exec);
-        if(err) {
-            list_free(&replies);
-            return SQLITE_ERROR;
-        }
+    for(i = 0; i < vtab->deletes.size; ++i) {
+        row_id = vector_get(&vtab->deletes, i);
+        if(redis_vtbl_vtab_write_delete(vtab, *row_id)) return SQLITE_ERROR;
     }
-    list_free(&replies);
-    
+    vector_clear(&vtab->deletes);
     return SQLITE_OK;
 }
-static int redis_vtbl_exec_delete(redis_vtbl_vtab *vtab, sqlite3_int64 row_id) {
-    int err;
-    redis_vtbl_command cmd;
-    list_t replies;
-    list_t expected;
-    list_t expected_exec;
-    
-    list_init(&expected, 0);
-    list_init(&expected_exec, 0);
-    
-    redis_vtbl_command_init_arg(&cmd, "MULTI");
-    redis_vtbl_connection_command_enqueue(&vtab->conn, &cmd);
-    list_push(&expected, redis_status_reply_p);
-    
-    redis_vtbl_command_init_arg(&cmd, "EVAL");                                                          /* erase from indexes */
-    redis_vtbl_command_arg(&cmd, "\
-        local key_base = ARGV[1];\n\
-        local row_id = ARGV[2];\n\
-        \n\
-        local indexed_columns = redis.call('SMEMBERS', key_base..'.indices');\n\
-        for _,column_name in ipairs(indexed_columns) do\n\
-            local column_value = redis.call('HGET', key_base..':'..row_id, column_name);\n\
-            local value_index = key_base..'.index:'..column_name..':'..column_value;\n\
-            redis.call('SREM', value_index, row_id);\n\
-            if(redis.call('EXISTS', value_index) == 0) then\n\
-                redis.call('ZREM', key_base..'.index:'..column_name, column_value);\n\
+
+/* Remove every row of the table along with the contents of its indexes in steps,
+ * none of which blocks redis for long:
+ * check    compares a range of the deleted rowids with the rowid index. The table's
+ *          generation, which the insert and delete scripts advance, must not change from
+ *          the first range to the rename so together the ranges compare the whole table.
+ * rename   renames the rowid zset and the index zsets aside so the table is empty at once.
+ * continue deletes up to ARGV[2] of the renamed values' sets, then rows. The value sets keep
+ *          their name; one recreated by an insert since the rename only loses the renamed rowids.
+ * The sequence and the set of indexed columns are kept.
+ * ARGV[1]  key_base
+ * ARGV[2]  chunk size
+ * ARGV[3]  1 to UNLINK rather than DEL
+ * ARGV[4]  check | rename | continue
+ * check    ARGV[5] rows in the table, ARGV[6] rank of the first rowid, ARGV[7] generation
+ *          returned by the first check; '' for the first, ARGV[8...] rowids in ascending order
+ * rename   ARGV[5] rows in the table, ARGV[6] generation
+ * Returns -1 if the table does not hold exactly the deleted rows, -2 if an earlier truncate
+ * is to be continued first; otherwise the generation from check, 2 from rename and from
+ * continue 1 while there is more to delete and 0 when done. */
+static const char redis_vtbl_script_truncate[] = "\
+    local key_base = ARGV[1];\n\
+    local n = tonumber(ARGV[2]);\n\
+    local del = ARGV[3] == '1' and 'UNLINK' or 'DEL';\n\
+    local step = ARGV[4];\n\
+    local rowids = key_base..'.index.rowid';\n\
+    local trash = key_base..'.truncate';\n\
+    local columns = redis.call('SMEMBERS', key_base..'.indices');\n\
+    \n\
+    if step ~= 'continue' then\n\
+        if redis.call('EXISTS', trash..'.rowid') == 1 then return -2 end\n\
+        local generation = tonumber(redis.call('GET', key_base..'.generation') or '0');\n\
+        if redis.call('ZCARD', rowids) ~= tonumber(ARGV[5]) then return -1 end\n\
+        if step == 'check' then\n\
+            if ARGV[7] ~= '' and tonumber(ARGV[7]) ~= generation then return -1 end\n\
+            local first = tonumber(ARGV[6]);\n\
+            local ids = redis.call('ZRANGE', rowids, first, first + #ARGV - 8);\n\
+            if #ids ~= #ARGV - 7 then return -1 end\n\
+            for i,id in ipairs(ids) do\n\
+                if id ~= ARGV[7 + i] then return -1 end\n\
             end\n\
+            return generation;\n\
         end\n\
-        return 1;\n");
-    redis_vtbl_command_arg(&cmd, "2");
-    redis_vtbl_command_arg_fmt(&cmd, "%s.indices", vtab->key_base);
-    redis_vtbl_command_arg_fmt(&cmd, "%s:%lld", vtab->key_base, row_id);
-    redis_vtbl_command_arg(&cmd, vtab->key_base);
-    redis_vtbl_command_arg_fmt(&cmd, "%lld", row_id);
-    redis_vtbl_connection_command_enqueue(&vtab->conn, &cmd);
-    list_push(&expected, redis_status_queued_reply_p);
-    list_push(&expected_exec, redis_integer_reply_p);
+        if tonumber(ARGV[6]) ~= generation then return -1 end\n\
+        redis.call('INCR', key_base..'.generation');\n\
+        redis.call('RENAME', rowids, trash..'.rowid');\n\
+        for _,column in ipairs(columns) do\n\
+            local index = key_base..'.index:'..column;\n\
+            if redis.call('EXISTS', index) == 1 then\n\
+                redis.call('RENAME', index, trash..':'..column);\n\
+            end\n\
+        end\n\
+        return 2;\n\
+    end\n\
+    \n\
+    for _,column in ipairs(columns) do\n\
+        local renamed = trash..':'..column;\n\
+        local values = redis.call('ZRANGE', renamed, 0, n-1);\n\
+        if #values > 0 then\n\
+            local index = key_base..'.index:'..column;\n\
+            for _,value in ipairs(values) do\n\
+                local set = index..':'..value;\n\
+                if redis.call('ZSCORE', index, value) then\n\
+                    for _,id in ipairs(redis.call('SMEMBERS', set)) do\n\
+                        if redis.call('ZSCORE', trash..'.rowid', id) then redis.call('SREM', set, id) end\n\
+                    end\n\
+                else\n\
+                    redis.call(del, set);\n\
+                end\n\
+            end\n\
+            redis.call('ZREMRANGEBYRANK', renamed, 0, #values-1);\n\
+            n = n - #values;\n\
+            if n <= 0 then return 1 end\n\
+        end\n\
+    end\n\
+    \n\
+    local ids = redis.call('ZRANGE', trash..'.rowid', 0, n-1);\n\
+    if #ids > 0 then\n\
+        local keys = {};\n\
+        for i,id in ipairs(ids) do keys[i] = key_base..':'..id end\n\
+        redis.call(del, unpack(keys));\n\
+        redis.call('ZREMRANGEBYRANK', trash..'.rowid', 0, #ids-1);\n\
+    end\n\
+    return redis.call('EXISTS', trash..'.rowid');\n";
+
+static int redis_vtbl_rowid_cmp(const sqlite3_int64 *l, const sqlite3_int64 *r) {
+    return *l < *r ? -1 : *l > *r;
+}
+
+/* One call of the truncate script; check sends the deleted rowids [first, first+count).
+ * Returns 0 with the script's result in status, 1 on error. */
+static int redis_vtbl_vtab_truncate_step(redis_vtbl_vtab *vtab, const char *step, size_t first, size_t count, long long generation, long long *status) {
+    redis_vtbl_command cmd;
+    redisReply *reply;
+    size_t i;
     
-    redis_vtbl_command_init_arg(&cmd, "DEL");                                                           /* erase object */
-    redis_vtbl_command_arg_fmt(&cmd, "%s:%lld", vtab->key_base, row_id);
-    redis_vtbl_connection_command_enqueue(&vtab->conn, &cmd);
-    list_push(&expected, redis_status_queued_reply_p);
-    list_push(&expected_exec, redis_integer_reply_p);
+    redis_vtbl_command_init_arg(&cmd, "0");
+    redis_vtbl_command_arg(&cmd, vtab->key_base);
+    redis_vtbl_command_arg_fmt(&cmd, "%d", VTAB_TRUNCATE_CHUNK);
+    redis_vtbl_command_arg(&cmd, vtab->unlink ? "1" : "0");
+    redis_vtbl_command_arg(&cmd, step);
+    if(strcmp(step, "continue")) {
+        redis_vtbl_command_arg_fmt(&cmd, "%lld", (long long)vtab->deletes.size);
+        if(!strcmp(step, "check")) {
+            redis_vtbl_command_arg_fmt(&cmd, "%lld", (long long)first);
+            if(first == 0)
+                redis_vtbl_command_arg(&cmd, "");
+            else
+                redis_vtbl_command_arg_fmt(&cmd, "%lld", generation);
+            for(i = first; i < first + count; ++i)
+                redis_vtbl_command_arg_fmt(&cmd, "%lld", *(sqlite3_int64*)vector_get(&vtab->deletes, i));
+        } else {
+            redis_vtbl_command_arg_fmt(&cmd, "%lld", generation);
+        }
+    }
     
-    redis_vtbl_command_init_arg(&cmd, "ZREM");                                                          /* erase from rowids */
-    redis_vtbl_command_arg_fmt(&cmd, "%s.index.rowid", vtab->key_base);
-    redis_vtbl_command_arg_fmt(&cmd, "%lld", row_id);
-    redis_vtbl_connection_command_enqueue(&vtab->conn, &cmd);
-    list_push(&expected, redis_status_queued_reply_p);
-    list_push(&expected_exec, redis_integer_reply_p);
+    reply = redis_vtbl_connection_eval(vtab->conn, redis_vtbl_script_truncate, &cmd);
+    if(!reply) return 1;
     
-    redis_vtbl_command_init_arg(&cmd, "EXEC");
-    redis_vtbl_connection_command_enqueue(&vtab->conn, &cmd);
-    list_push(&expected, redis_bulk_reply_p);
+    if(reply->type != REDIS_REPLY_INTEGER) {
+#ifndef QUIET
+        if(reply->type == REDIS_REPLY_ERROR) fprintf(stderr, "-ERR %s\n", reply->str);
+#endif
+        freeReplyObject(reply);
+        return 1;
+    }
+    *status = reply->integer;
+    freeReplyObject(reply);
+    return 0;
+}
 
-    list_init(&replies, freeReplyObject);
-    redis_vtbl_connection_read_queued(&vtab->conn, &replies);
+/* Truncate the table if the buffered deletes cover every row.
+ * Deleted rowids are distinct rows that were read from the table; the script checks that
+ * they are exactly the rows the table holds, so concurrent writes are never lost.
+ * Returns 0 once truncated, -1 if the deletes are not for the whole table, 1 on error. */
+static int redis_vtbl_vtab_truncate(redis_vtbl_vtab *vtab) {
+    redis_vtbl_command cmd;
+    redisReply *reply;
+    long long status;
+    long long generation;
+    int truncated;
+    size_t n;
+    size_t i;
     
-    err = redis_check_expected_list(&replies, &expected);
-    list_free(&expected);
+    /* a large delete is only sent in full if it may be for the whole table */
+    n = vtab->deletes.size;
+    if(n >= VTAB_TRUNCATE_CHUNK) {
+        redis_vtbl_command_init_arg(&cmd, "ZCARD");
+        redis_vtbl_command_arg_fmt(&cmd, "%s.index.rowid", vtab->key_base);
+        reply = redis_vtbl_connection_command(vtab->conn, &cmd);
+        if(!reply) return 1;
+        status = reply->type == REDIS_REPLY_INTEGER ? reply->integer : -1;
+        freeReplyObject(reply);
+        if(status != (long long)n) return -1;
+    }
     
-    if(err) {
-        list_free(&replies);
-        list_free(&expected_exec);
-        return SQLITE_ERROR;
+    vector_sort(&vtab->deletes, (int (*)(const void *, const void *))redis_vtbl_rowid_cmp);
     
-    } else {
-        redisReply *exec_reply;
-        exec_reply = list_get(&replies, replies.size-1);
-        err = redis_check_expected_bulk_list(exec_reply, &expected_exec);
-        list_free(&expected_exec);
-        if(err) {
-            list_free(&replies);
-            return SQLITE_ERROR;
+    for(;;) {
+        generation = 0;
+        status = 0;
+        for(i = 0; i < n && status >= 0; i += VTAB_TRUNCATE_CHUNK) {
+            if(redis_vtbl_vtab_truncate_step(vtab, "check", i, n - i < VTAB_TRUNCATE_CHUNK ? n - i : VTAB_TRUNCATE_CHUNK, generation, &status))
+                return 1;
+            if(status >= 0) generation = status;
         }
+        if(status >= 0 && redis_vtbl_vtab_truncate_step(vtab, "rename", 0, 0, generation, &status))
+            return 1;
+        if(status == -1) return -1;
+        truncated = status == 2;
+        
+        /* delete the renamed rows; -2 is a truncate left unfinished, completed before this one */
+        do {
+            if(redis_vtbl_vtab_truncate_step(vtab, "continue", 0, 0, 0, &status)) return 1;
+        } while(status != 0);
+        if(truncated) return 0;
     }
-    list_free(&replies);
+}
+
+/* Mutations are buffered in the vtab for the duration of the sqlite transaction
+ * and sent at xSync as one MULTI/EXEC pipeline. Reads flush the buffer first so
+ * that a transaction sees its own writes; those writes can no longer be rolled back. */
+static int redis_vtbl_begin(sqlite3_vtab *pVTab) {
+    redis_vtbl_vtab *vtab;
     
+    vtab = (redis_vtbl_vtab*)pVTab;
+    redis_vtbl_connection_watch(vtab->conn);
+    redis_vtbl_vtab_discard(vtab);
+    vtab->writing = 1;          /* xBegin is only called for statements that write the table */
+    return SQLITE_OK;
+}
+
+static int redis_vtbl_sync(sqlite3_vtab *pVTab) {
+    redis_vtbl_vtab *vtab;
+    
+    vtab = (redis_vtbl_vtab*)pVTab;
+    if(redis_vtbl_vtab_flush(vtab)) {
+        pVTab->zErrMsg = sqlite3_mprintf("Unable to commit buffered writes");
+        return SQLITE_ERROR;
+    }
+    return SQLITE_OK;
+}
+
+/* the transaction's writes must be seen by the next read */
+static void redis_vtbl_vtab_end(redis_vtbl_vtab *vtab) {
+    if(vtab->writing) vtab->written = 1;
+    vtab->writing = 0;
+}
+
+static int redis_vtbl_commit(sqlite3_vtab *pVTab) {
+    int rc;
+    rc = redis_vtbl_sync(pVTab);
+    redis_vtbl_vtab_end((redis_vtbl_vtab*)pVTab);
+    return rc;
+}
+
+static int redis_vtbl_rollback(sqlite3_vtab *pVTab) {
+    redis_vtbl_vtab_discard((redis_vtbl_vtab*)pVTab);
+    redis_vtbl_vtab_end((redis_vtbl_vtab*)pVTab);      /* reads may have flushed writes */
     return SQLITE_OK;
 }
 
@@ -888,52 +2022,130 @@ static int redis_vtbl_cursor_init(redis_vtbl_cursor *cur, redis_vtbl_vtab *vtab)
     memset(&cur->base, 0, sizeof(sqlite3_vtab_cursor));
 
     cur->vtab = vtab;
+    cur->conn = vtab->conn;
+    
+    vector_init(&cur->projection, sizeof(size_t), 0);
     
     vector_init(&cur->rows, sizeof(int64_t), 0);
     cur->current_row = 0;
     
-    list_init(&cur->column_data, free);
+    cur->scan = 0;
+    cur->scan_order = 1;
+    cur->scan_index = -1;
+    cur->scan_min[0] = 0;
+    cur->scan_max[0] = 0;
+    cur->scan_offset = 0;
+    cur->scan_page = CURSOR_SCAN_PAGE;
+    cur->skip = 0;
+    cur->limit = -1;
+    list_init(&cur->filter, free);
+    
+    cur->counting = 0;
+    cur->count = 0;
+    cur->count_pos = 0;
+    
+    list_init(&cur->row_data, freeReplyObject);
+    cur->row_data_begin = 0;
+    cur->batch_size = 1;
+    
+    list_init(&cur->column_data, 0);     /* elements of the row_data replies */
     cur->column_data_valid = 0;
     
     return SQLITE_OK;
 }
 
-/*
-Thoughts for cursor get:
-It would be good to retrieve batched row data.
-i.e. first get retrieves one row
-next 2
-next 4, etc (n * 1.618)
+static void redis_vtbl_cursor_reset(redis_vtbl_cursor *cur) {
+    cur->scan = 0;
+    cur->scan_order = 1;
+    cur->scan_index = -1;
+    cur->scan_page = CURSOR_SCAN_PAGE;
+    cur->skip = 0;
+    cur->limit = -1;
+    cur->counting = 0;
+    list_clear(&cur->filter);
+    list_clear(&cur->row_data);
+    cur->row_data_begin = 0;
+    cur->batch_size = 1;
+    cur->column_data_valid = 0;
+}
 
-Additionally it would be good to not retrieve the entire row,
-but only the subset of columns that are going to be requested.
-*/
-/* retrieve column_data for current_row */
-static void redis_vtbl_cursor_get(redis_vtbl_cursor *cur) {
+/* retrieve row data for the batch of rows starting at current_row.
+ * Row data is retrieved in batches of increasing size, i.e.
+ * first get retrieves one row
+ * next 2
+ * next 4, etc (n * 1.618)
+ * The HMGETs for a batch are pipelined so each batch costs a single round trip. */
+static int redis_vtbl_cursor_fetch(redis_vtbl_cursor *cur) {
     int err;
-    int eof;
     redis_vtbl_vtab *vtab;
     redis_vtbl_command cmd;
-    redisReply *reply;
+    sqlite3_int64 *row;
+    sqlite3_int64 *end;
     size_t i;
+    size_t *column;
     redis_vtbl_column_spec *cspec;
+    
+    vtab = cur->vtab;
+    list_clear(&cur->row_data);
+    cur->row_data_begin = 0;
+    
+    end = vector_end(&cur->rows);
+    if((size_t)(end - cur->current_row) > cur->batch_size)
+        end = cur->current_row + cur->batch_size;
+    
+    for(row = cur->current_row; row != end; ++row) {
+        /* HMGET key_base.row column0 ...columnN (projected columns only) */
+        redis_vtbl_command_init_arg(&cmd, "HMGET");
+        redis_vtbl_command_arg_fmt(&cmd, "%s:%lld", vtab->key_base, *row);
+        
+        for(i = 0; i < cur->projection.size; ++i) {
+            column = vector_get(&cur->projection, i);
+            cspec = vector_get(&vtab->columns, *column);
+            redis_vtbl_command_arg(&cmd, cspec->name);
+        }
+        redis_vtbl_connection_command_enqueue(cur->conn, &cmd);
+    }
+    
+    err = redis_vtbl_connection_read_queued(cur->conn, &cur->row_data);
+    if(err || cur->row_data.size != (size_t)(end - cur->current_row)) {
+        list_clear(&cur->row_data);
+        return 1;
+    }
+    cur->row_data_begin = cur->current_row;
+    
+    cur->batch_size = ceil(cur->batch_size * 1.618);
+    if(cur->batch_size > CURSOR_BATCH_MAX)
+        cur->batch_size = CURSOR_BATCH_MAX;
+    return 0;
+}
+
+/* retrieve column_data for current_row
+ * column_data is indexed by column number; columns outside the projection are null. */
+static void redis_vtbl_cursor_get(redis_vtbl_cursor *cur) {
+    int err;
+    int eof;
+    redisReply *reply;
+    size_t i;
+    size_t *column;
 
     eof = cur->current_row == vector_end(&cur->rows);
     if(eof) return;
     
-    vtab = cur->vtab;
     list_clear(&cur->column_data);
-
-    /* HMGET key_base.current_row column0 ...columnN */
-    redis_vtbl_command_init_arg(&cmd, "HMGET");
-    redis_vtbl_command_arg_fmt(&cmd, "%s:%lld", vtab->key_base, *cur->current_row);
     
-    for(i = 0; i < vtab->columns.size; ++i) {
-        cspec = vector_get(&vtab->columns, i);
-        redis_vtbl_command_arg(&cmd, cspec->name);
+    if(cur->projection.size == 0) {
+        /* no columns referenced (e.g. count(*)); nothing to retrieve */
+        cur->column_data_valid = 1;
+        return;
+    }
+
+    if(!cur->row_data_begin || cur->current_row < cur->row_data_begin || 
+            cur->current_row >= cur->row_data_begin + cur->row_data.size) {
+        err = redis_vtbl_cursor_fetch(cur);
+        if(err) return;
     }
     
-    reply = redis_vtbl_connection_command(&vtab->conn, &cmd);
+    reply = list_get(&cur->row_data, cur->current_row - cur->row_data_begin);
     if(!reply) return;
     
     /* note: This implementation differs from the prototype.
@@ -941,14 +2153,26 @@ static void redis_vtbl_cursor_get(redis_vtbl_cursor *cur) {
      * the next record was automatically retrieved.
      * This version will return a row full of null values.
      * It is uncertain at this time which approach is better. */
-    err = redis_reply_string_list(&cur->column_data, reply);
-    freeReplyObject(reply);
-    if(err) return;
+    if(reply->type != REDIS_REPLY_ARRAY || reply->elements != cur->projection.size)
+        return;
+    
+    /* values are referenced in place, not copied; they may be binary */
+    for(i = 0; i < cur->vtab->columns.size; ++i)
+        list_push(&cur->column_data, 0);
+    for(i = 0; i < reply->elements; ++i) {
+        if(reply->element[i]->type != REDIS_REPLY_STRING) continue;
+        column = vector_get(&cur->projection, i);
+        list_set(&cur->column_data, *column, reply->element[i]);
+    }
+    
     cur->column_data_valid = 1;
 }
 
 static void redis_vtbl_cursor_free(redis_vtbl_cursor *cur) {
+    vector_free(&cur->projection);
     vector_free(&cur->rows);
+    list_free(&cur->filter);
+    list_free(&cur->row_data);
     list_free(&cur->column_data);
 }
 
@@ -981,356 +2205,856 @@ static int redis_vtbl_cursor_close(sqlite3_vtab_cursor *pCursor) {
     
     return SQLITE_OK;
 }
-
-static int redis_vtbl_cursor_filter_scan(redis_vtbl_cursor *cursor);
-static int redis_vtbl_cursor_filter_rowid(redis_vtbl_cursor *cursor, sqlite3_int64 row_id, int idxNum);
-static int redis_vtbl_cursor_filter_index(redis_vtbl_cursor *cursor, int idxNum, const char *idxStr, sqlite3_value *value);
+
+static int redis_vtbl_cursor_filter_scan(redis_vtbl_cursor *cursor, const char *min, const char *max);
+static int redis_vtbl_cursor_filter_rowid(redis_vtbl_cursor *cursor, sqlite3_int64 row_id, int idxNum);
+static int redis_vtbl_cursor_filter_lookup(redis_vtbl_cursor *cursor, redis_vtbl_plan *plan, int argc, sqlite3_value **argv);
+static int redis_vtbl_cursor_filter_ordered(redis_vtbl_cursor *cursor, int index);
+static int redis_vtbl_cursor_filter_count(redis_vtbl_cursor *cursor);
+/* Prepare the constraints evaluated by the filter script.
+ * *none is set if a constraint can never be satisfied. */
+static int redis_vtbl_cursor_filter_terms(redis_vtbl_cursor *cursor, redis_vtbl_plan *plan, int argc, sqlite3_value **argv, int *none) {
+    size_t i;
+    redis_vtbl_plan_term *term;
+    redis_vtbl_column_spec *cspec;
+    sqlite3_value *value;
+    const char *op;
+    int numeric;
+    
+    *none = 0;
+    if((size_t)argc < plan->filter.size) return SQLITE_ERROR;
+    
+    for(i = 0; i < plan->filter.size; ++i) {
+        term = vector_get(&plan->filter, i);
+        value = argv[i];
+        
+        cspec = vector_get(&cursor->vtab->columns, term->column);
+        if(!cspec) return SQLITE_ERROR;
+        
+        /* comparison with null is never true */
+        if(sqlite3_value_type(value) == SQLITE_NULL) {
+            *none = 1;
+            return SQLITE_OK;
+        }
+        
+        op = redis_vtbl_filter_op(term->op);
+        
+        /* sqlite orders numbers before text; such a comparison only depends on the value being non null */
+        numeric = cspec->data_type != SQLITE_TEXT;
+        if(numeric) {
+            int type = sqlite3_value_numeric_type(value);
+            if(type != SQLITE_INTEGER && type != SQLITE_FLOAT) {
+                switch(term->op) {
+                    case SQLITE_INDEX_CONSTRAINT_LT:
+                    case SQLITE_INDEX_CONSTRAINT_LE:
+                    case SQLITE_INDEX_CONSTRAINT_NE:
+                        op = "nn";
+                        value = 0;
+                        break;
+                    default:
+                        *none = 1;
+                        return SQLITE_OK;
+                }
+            }
+        }
+        
+        if(list_push(&cursor->filter, strdup(cspec->name)) ||
+            list_push(&cursor->filter, strdup(op)) ||
+            list_push(&cursor->filter, strdup(value ? (const char*)sqlite3_value_text(value) : "0")) ||
+            list_push(&cursor->filter, strdup(cspec->data_type == SQLITE_INTEGER ? "i" : numeric ? "f" : "t")))
+            return SQLITE_NOMEM;
+    }
+    
+    return SQLITE_OK;
+}
 static int redis_vtbl_cursor_filter(sqlite3_vtab_cursor *pCursor, int idxNum, const char *idxStr, int argc, sqlite3_value **argv) {
     int err;
     redis_vtbl_cursor *cursor;
+    redis_vtbl_plan plan;
     sqlite3_int64 row_id;
+    size_t i;
+    int none;
     
     cursor = (redis_vtbl_cursor*)pCursor;
     vector_clear(&cursor->rows);
+    cursor->current_row = vector_begin(&cursor->rows);
+    redis_vtbl_cursor_reset(cursor);
+    
+    redis_vtbl_connection_watch(cursor->vtab->conn);    /* follow a failover before the scan */
+    if(redis_vtbl_vtab_flush(cursor->vtab)) return SQLITE_ERROR;    /* read the transaction's own writes */
+    if(cursor->vtab->flusher && redis_vtbl_flusher_drain(cursor->vtab->flusher)) {
+        cursor->vtab->base.zErrMsg = sqlite3_mprintf("Write behind failed; writes were lost");
+        return SQLITE_ERROR;
+    }
+    
+    /* Statements that write the table read from the master; after a write
+     * a replica is only read once it has caught up. */
+    if(cursor->vtab->writing) {
+        cursor->conn = cursor->vtab->conn;
+    } else {
+        cursor->conn = redis_vtbl_connection_reader(cursor->vtab->conn, cursor->vtab->written, cursor->vtab->read_replicas);
+        if(cursor->conn != cursor->vtab->conn) cursor->vtab->written = 0;
+    }
+    
+    err = redis_vtbl_plan_parse(&plan, idxStr);
+    if(err) return SQLITE_ERROR;                    /* Internal error. malformed plan from bestindex */
+    
+    /* colUsed: bit 63 stands for all columns from 63 onwards */
+    vector_clear(&cursor->projection);
+    for(i = 0; i < cursor->vtab->columns.size; ++i) {
+        if(plan.columns & ((sqlite3_uint64)1 << (i < 63 ? i : 63)))
+            vector_push(&cursor->projection, &i);
+    }
+    
+    if(redis_vtbl_scan_p(idxNum)) {
+        int first = (idxNum == CURSOR_INDEX_SCAN || idxNum == CURSOR_INDEX_ORDERED) ? 0 : 1;
+        
+        err = first <= argc ? redis_vtbl_cursor_filter_terms(cursor, &plan, argc - first, argv + first, &none) : SQLITE_ERROR;
+        if(err || none) {
+            redis_vtbl_plan_free(&plan);
+            return err;
+        }
+    }
+    
+    /* LIMIT / OFFSET window; negative values are no limit and no offset */
+    if(plan.limit >= 0 && plan.limit < argc) {
+        cursor->limit = sqlite3_value_int64(argv[plan.limit]);
+        if(cursor->limit < 0) cursor->limit = -1;
+    }
+    if(plan.offset >= 0 && plan.offset < argc) {
+        cursor->skip = sqlite3_value_int64(argv[plan.offset]);
+        if(cursor->skip < 0) cursor->skip = 0;
+    }
+    if(cursor->limit == 0) {
+        redis_vtbl_plan_free(&plan);
+        return SQLITE_OK;
+    }
+    if(cursor->limit > 0)           /* every row in the window is returned; fetch them together */
+        cursor->batch_size = cursor->limit < CURSOR_BATCH_MAX ? cursor->limit : CURSOR_BATCH_MAX;
+    
     err = SQLITE_ERROR;
+    
+    if(plan.order) {
+        cursor->scan_order = plan.order;
+        if(cursor->limit < 0) cursor->scan_page = 1;
+    }
 
     switch(idxNum) {
         case CURSOR_INDEX_SCAN:
-            err = redis_vtbl_cursor_filter_scan(cursor);
+            if(cursor->projection.size == 0 && cursor->filter.size == 0 && !plan.order)
+                err = redis_vtbl_cursor_filter_count(cursor);
+            else
+                err = redis_vtbl_cursor_filter_scan(cursor, "-inf", "+inf");
             break;
         case CURSOR_INDEX_ROWID_EQ:
         case CURSOR_INDEX_ROWID_GT:
         case CURSOR_INDEX_ROWID_LT:
         case CURSOR_INDEX_ROWID_GE:
         case CURSOR_INDEX_ROWID_LE:
-            if(argc == 0) return SQLITE_ERROR;          /* Internal error. row_id not passed after request in bestindex */
+            if(argc == 0) break;                        /* Internal error. row_id not passed after request in bestindex */
             row_id = sqlite3_value_int64(argv[0]);
             err = redis_vtbl_cursor_filter_rowid(cursor, row_id, idxNum);
             break;
-        case CURSOR_INDEX_NAMED_EQ:
-        case CURSOR_INDEX_NAMED_GT:
-        case CURSOR_INDEX_NAMED_LT:
-        case CURSOR_INDEX_NAMED_GE:
-        case CURSOR_INDEX_NAMED_LE:
-            if(argc == 0) return SQLITE_ERROR;          /* Internal error. value not passed after request in bestindex */
-            err = redis_vtbl_cursor_filter_index(cursor, idxNum, idxStr, argv[0]);
+        case CURSOR_INDEX_LOOKUP:
+            err = redis_vtbl_cursor_filter_lookup(cursor, &plan, argc, argv);
+            break;
+        case CURSOR_INDEX_ORDERED:
+            err = redis_vtbl_cursor_filter_ordered(cursor, plan.index);
             break;
     }
     
+    /* at most one row */
+    if(!err && idxNum == CURSOR_INDEX_ROWID_EQ && cursor->skip > 0)
+        vector_clear(&cursor->rows);
+    redis_vtbl_plan_free(&plan);
+    
     if(!err) {
         cursor->current_row = vector_begin(&cursor->rows);
         cursor->column_data_valid = 0;
     }
     return err;
 }
-static int redis_vtbl_cursor_filter_scan(redis_vtbl_cursor *cursor) {
+
+/* Lua function shared by the scan scripts.
+ * Evaluates the constraints ARGV[first...] against rows, appending the matching rowids to result.
+ * The first skip matches are skipped and at most count (-1 unlimited) are appended.
+ * Returns the number of matches skipped.
+ * ARGV[first...] column, op, value, type ('i'nteger | 'f'loat | 't'ext) for each constraint
+ * op is eq | ne | gt | ge | lt | le or nn, true for any non null value
+ * Values are read as redis_vtbl_cursor_column does: integers as strtoll and text
+ * bytewise (BINARY); lua's own string comparison follows the server's locale. */
+#define REDIS_VTBL_LUA_FILTER "\
+    local function bytecmp(a, b)\n\
+        if a == b then return 0 end\n\
+        for k = 1, math.min(#a, #b) do\n\
+            local x, y = string.byte(a, k), string.byte(b, k);\n\
+            if x ~= y then return x < y and -1 or 1 end\n\
+        end\n\
+        return #a < #b and -1 or 1;\n\
+    end\n\
+    local function integer(s)\n\
+        local sign, digits = string.match(s, '^%s*([-+]?)(%d+)$');\n\
+        if not digits then return nil end\n\
+        digits = string.gsub(digits, '^0+', '');\n\
+        if digits == '' then return '', '0' end\n\
+        if sign == '+' then sign = '' end\n\
+        if #digits > 19 or (#digits == 19 and bytecmp(digits, sign == '-' and '9223372036854775808' or '9223372036854775807') > 0) then\n\
+            return nil;\n\
+        end\n\
+        return sign, digits;\n\
+    end\n\
+    local function numcmp(x, y)\n\
+        if not x or not y or x ~= x or y ~= y then return nil end\n\
+        return x < y and -1 or x > y and 1 or 0;\n\
+    end\n\
+    local function compare(ty, l, r)\n\
+        if ty == 't' then return bytecmp(l, r) end\n\
+        if l == '' then l = '0' end\n\
+        if ty == 'f' then return numcmp(tonumber(l), tonumber(r)) end\n\
+        local ls, ld = integer(l);\n\
+        if not ls then return nil end\n\
+        local rs, rd = integer(r);\n\
+        if not rs then return numcmp(tonumber(ls..ld), tonumber(r)) end\n\
+        if ls ~= rs then return ls == '-' and -1 or 1 end\n\
+        local c = #ld ~= #rd and (#ld < #rd and -1 or 1) or bytecmp(ld, rd);\n\
+        return ls == '-' and -c or c;\n\
+    end\n\
+    local function filter(key_base, rows, first, skip, count, result)\n\
+        local columns = {};\n\
+        for t = first, #ARGV, 4 do\n\
+            columns[#columns+1] = ARGV[t];\n\
+        end\n\
+        local skipped = 0;\n\
+        for _,row_id in ipairs(rows) do\n\
+            if count == 0 then break end\n\
+            local match = true;\n\
+            local values = {};\n\
+            if #columns > 0 then\n\
+                values = redis.call('HMGET', key_base..':'..row_id, unpack(columns));\n\
+            end\n\
+            for i = 1, #columns do\n\
+                local t = first + (i-1)*4;\n\
+                local op, c = ARGV[t+1], nil;\n\
+                if values[i] then c = compare(ARGV[t+3], values[i], ARGV[t+2]) end\n\
+                if not c then match = false;\n\
+                elseif op == 'eq' then match = c == 0;\n\
+                elseif op == 'ne' then match = c ~= 0;\n\
+                elseif op == 'gt' then match = c > 0;\n\
+                elseif op == 'ge' then match = c >= 0;\n\
+                elseif op == 'lt' then match = c < 0;\n\
+                elseif op == 'le' then match = c <= 0;\n\
+                elseif op == 'nn' then match = true;\n\
+                end\n\
+                if not match then break end\n\
+            end\n\
+            if match then\n\
+                if skipped < skip then\n\
+                    skipped = skipped + 1;\n\
+                else\n\
+                    result[#result+1] = row_id;\n\
+                    count = count - 1;\n\
+                end\n\
+            end\n\
+        end\n\
+        return skipped;\n\
+    end\n"
+
+/* Page through the rowid index evaluating the filter constraints against each row.
+ * KEYS[1]  rowid index
+ * ARGV[1]  key_base
+ * ARGV[2]  min rowid
+ * ARGV[3]  max rowid
+ * ARGV[4]  page size
+ * ARGV[5]  asc | desc
+ * ARGV[6]  matches to skip
+ * ARGV[7]  matches to return; -1 unlimited
+ * ARGV[8...] filter constraints
+ * Returns the number of rowids examined, the last rowid examined, the number
+ * of matches skipped, then the matching rowids. */
+static const char redis_vtbl_script_filter[] = REDIS_VTBL_LUA_FILTER "\
+    local rows;\n\
+    if ARGV[5] == 'desc' then\n\
+        rows = redis.call('ZREVRANGEBYSCORE', KEYS[1], ARGV[3], ARGV[2], 'LIMIT', 0, tonumber(ARGV[4]));\n\
+    else\n\
+        rows = redis.call('ZRANGEBYSCORE', KEYS[1], ARGV[2], ARGV[3], 'LIMIT', 0, tonumber(ARGV[4]));\n\
+    end\n\
+    local result = { #rows, rows[#rows] or '', 0 };\n\
+    result[3] = filter(ARGV[1], rows, 8, tonumber(ARGV[6]), tonumber(ARGV[7]), result);\n\
+    return result;\n";
+
+/* Page through a column index in value order, evaluating the filter constraints against each row.
+ * ARGV[1]  key_base
+ * ARGV[2]  column
+ * ARGV[3]  rank of the first value
+ * ARGV[4]  page size
+ * ARGV[5]  asc | desc
+ * ARGV[6]  matches to skip
+ * ARGV[7]  matches to return; -1 unlimited
+ * ARGV[8...] filter constraints
+ * Returns the number of values examined, '', the number of matches skipped, then the matching rowids. */
+static const char redis_vtbl_script_ordered[] = REDIS_VTBL_LUA_FILTER "\
+    local index = ARGV[1]..'.index:'..ARGV[2];\n\
+    local first = tonumber(ARGV[3]);\n\
+    local last = first + tonumber(ARGV[4]) - 1;\n\
+    local values;\n\
+    if ARGV[5] == 'desc' then\n\
+        values = redis.call('ZREVRANGE', index, first, last);\n\
+    else\n\
+        values = redis.call('ZRANGE', index, first, last);\n\
+    end\n\
+    local rows = {};\n\
+    local truncating = redis.call('EXISTS', ARGV[1]..'.truncate.rowid') == 1;\n\
+    for _,value in ipairs(values) do\n\
+        for _,row_id in ipairs(redis.call('SMEMBERS', index..':'..value)) do\n\
+            if not truncating or redis.call('ZSCORE', ARGV[1]..'.index.rowid', row_id) then rows[#rows+1] = row_id end\n\
+        end\n\
+    end\n\
+    local result = { #values, '', 0 };\n\
+    result[3] = filter(ARGV[1], rows, 8, tonumber(ARGV[6]), tonumber(ARGV[7]), result);\n\
+    return result;\n";
+
+/* examined, last, skipped, rowid... */
+static int redis_vtbl_filter_reply(vector_t *rows, redisReply *reply, long long *examined, char *last, size_t last_size, long long *skipped) {
+    size_t i;
+    sqlite3_int64 row_id;
+    char *end;
+    
+    if(reply->type != REDIS_REPLY_ARRAY || reply->elements < 3) return 1;
+    if(reply->element[0]->type != REDIS_REPLY_INTEGER) return 1;
+    if(reply->element[1]->type != REDIS_REPLY_STRING) return 1;
+    if(reply->element[2]->type != REDIS_REPLY_INTEGER) return 1;
+    
+    *examined = reply->element[0]->integer;
+    snprintf(last, last_size, "%s", reply->element[1]->str);
+    *skipped = reply->element[2]->integer;
+    
+    for(i = 3; i < reply->elements; ++i) {
+        redisReply *element;
+        element = reply->element[i];
+        
+        if(element->type != REDIS_REPLY_STRING) return 1;
+        
+        errno = 0;
+        row_id = strtoll(element->str, &end, 10);
+        if(errno || *end)       /* out-of-range | rubbish characters */
+            continue;
+        
+        if(vector_push(rows, &row_id)) return 1;
+    }
+    return 0;
+}
+
+/* Page the next scan_page rowids in [scan_min, scan_max] into rows,
+ * or the rowids of the next scan_page values of the scan_index column.
+ * Pages resume from the last rowid (or value rank) seen so the scan neither blocks redis
+ * nor holds the entire table's rowids in memory.
+ * If filter constraints are present only the matching rowids of each page are returned. */
+static int redis_vtbl_cursor_scan_page(redis_vtbl_cursor *cursor) {
     int err;
     redis_vtbl_vtab *vtab;
     redis_vtbl_command cmd;
     redisReply *reply;
+    redis_vtbl_column_spec *cspec;
+    size_t i;
+    long long examined;
+    long long skipped;
+    long long count;
+    char last[24];
+    const char *order;
+    
+    vtab = cursor->vtab;
+    order = cursor->scan_order < 0 ? "desc" : "asc";
+    
+    /* row_data refers to the previous page */
+    list_clear(&cursor->column_data);
+    cursor->column_data_valid = 0;
+    list_clear(&cursor->row_data);
+    cursor->row_data_begin = 0;
+    vector_clear(&cursor->rows);
+    cursor->current_row = vector_begin(&cursor->rows);
+    
+    /* a filtered page may not match any rows; continue until one does */
+    while(cursor->scan && cursor->rows.size == 0) {
+        count = cursor->scan_page;          /* rowids or values requested */
+        
+        if(cursor->scan_index >= 0) {
+            cspec = vector_get(&vtab->columns, cursor->scan_index);
+            if(!cspec) {
+                cursor->scan = 0;
+                return SQLITE_ERROR;
+            }
+            
+            redis_vtbl_command_init_arg(&cmd, "0");
+            redis_vtbl_command_arg(&cmd, vtab->key_base);
+            redis_vtbl_command_arg(&cmd, cspec->name);
+            redis_vtbl_command_arg_fmt(&cmd, "%lld", cursor->scan_offset);
+            redis_vtbl_command_arg_fmt(&cmd, "%lld", count);
+            redis_vtbl_command_arg(&cmd, order);
+            redis_vtbl_command_arg_fmt(&cmd, "%lld", cursor->skip);
+            redis_vtbl_command_arg_fmt(&cmd, "%lld", cursor->limit);
+            for(i = 0; i < cursor->filter.size; ++i)
+                redis_vtbl_command_arg(&cmd, list_get(&cursor->filter, i));
+            reply = redis_vtbl_connection_eval(cursor->conn, redis_vtbl_script_ordered, &cmd);
+        } else if(cursor->filter.size) {
+            redis_vtbl_command_init_arg(&cmd, "1");
+            redis_vtbl_command_arg_fmt(&cmd, "%s.index.rowid", vtab->key_base);
+            redis_vtbl_command_arg(&cmd, vtab->key_base);
+            redis_vtbl_command_arg(&cmd, cursor->scan_min);
+            redis_vtbl_command_arg(&cmd, cursor->scan_max);
+            redis_vtbl_command_arg_fmt(&cmd, "%lld", count);
+            redis_vtbl_command_arg(&cmd, order);
+            redis_vtbl_command_arg_fmt(&cmd, "%lld", cursor->skip);
+            redis_vtbl_command_arg_fmt(&cmd, "%lld", cursor->limit);
+            for(i = 0; i < cursor->filter.size; ++i)
+                redis_vtbl_command_arg(&cmd, list_get(&cursor->filter, i));
+            reply = redis_vtbl_connection_eval(cursor->conn, redis_vtbl_script_filter, &cmd);
+        } else {
+            if(cursor->limit >= 0 && cursor->limit < count)
+                count = cursor->limit;
+            
+            if(cursor->scan_order < 0) {
+                redis_vtbl_command_init_arg(&cmd, "ZREVRANGEBYSCORE");
+                redis_vtbl_command_arg_fmt(&cmd, "%s.index.rowid", vtab->key_base);
+                redis_vtbl_command_arg(&cmd, cursor->scan_max);
+                redis_vtbl_command_arg(&cmd, cursor->scan_min);
+            } else {
+                redis_vtbl_command_init_arg(&cmd, "ZRANGEBYSCORE");
+                redis_vtbl_command_arg_fmt(&cmd, "%s.index.rowid", vtab->key_base);
+                redis_vtbl_command_arg(&cmd, cursor->scan_min);
+                redis_vtbl_command_arg(&cmd, cursor->scan_max);
+            }
+            redis_vtbl_command_arg(&cmd, "LIMIT");
+            redis_vtbl_command_arg_fmt(&cmd, "%lld", cursor->skip);
+            redis_vtbl_command_arg_fmt(&cmd, "%lld", count);
+            reply = redis_vtbl_connection_command(cursor->conn, &cmd);
+        }
+        if(!reply) {
+            cursor->scan = 0;
+            return SQLITE_ERROR;
+        }
+        
+        if(cursor->scan_index >= 0 || cursor->filter.size) {
+            err = redis_vtbl_filter_reply(&cursor->rows, reply, &examined, last, sizeof(last), &skipped);
+        } else {
+            err = redis_reply_numeric_array(&cursor->rows, reply);
+            examined = cursor->rows.size;
+            skipped = cursor->skip;             /* a short page is the end of the scan */
+            if(!err && examined) {
+                sqlite3_int64 *row;
+                row = vector_get(&cursor->rows, cursor->rows.size - 1);
+                snprintf(last, sizeof(last), "%lld", *row);
+            }
+        }
+        freeReplyObject(reply);
+        cursor->current_row = vector_begin(&cursor->rows);
+        if(err) {
+            cursor->scan = 0;
+            return SQLITE_ERROR;
+        }
+        
+        cursor->skip -= skipped;
+        if(cursor->limit >= 0)
+            cursor->limit -= cursor->rows.size;
+        
+        /* small first pages so top-1 queries e.g. max() only read what they need */
+        if(cursor->scan_page < CURSOR_SCAN_PAGE) {
+            cursor->scan_page *= CURSOR_SCAN_GROWTH;
+            if(cursor->scan_page > CURSOR_SCAN_PAGE)
+                cursor->scan_page = CURSOR_SCAN_PAGE;
+        }
+        
+        if(examined < count || cursor->limit == 0)
+            cursor->scan = 0;           /* exhausted */
+        else if(cursor->scan_index >= 0)
+            cursor->scan_offset += examined;
+        else if(cursor->scan_order < 0) /* resume after the last rowid examined */
+            snprintf(cursor->scan_max, sizeof(cursor->scan_max), "(%s", last);
+        else
+            snprintf(cursor->scan_min, sizeof(cursor->scan_min), "(%s", last);
+    }
+    return SQLITE_OK;
+}
+static int redis_vtbl_cursor_filter_scan(redis_vtbl_cursor *cursor, const char *min, const char *max) {
+    snprintf(cursor->scan_min, sizeof(cursor->scan_min), "%s", min);
+    snprintf(cursor->scan_max, sizeof(cursor->scan_max), "%s", max);
+    cursor->scan_index = -1;
+    cursor->scan = 1;
+    
+    return redis_vtbl_cursor_scan_page(cursor);
+}
+/* Count the rows of the table (within the LIMIT / OFFSET window) without retrieving their rowids.
+ * Satisfies count(*) with a single ZCARD. */
+static int redis_vtbl_cursor_filter_count(redis_vtbl_cursor *cursor) {
+    redis_vtbl_vtab *vtab;
+    redis_vtbl_command cmd;
+    redisReply *reply;
     
     vtab = cursor->vtab;
     
-    redis_vtbl_command_init_arg(&cmd, "ZRANGE");
+    redis_vtbl_command_init_arg(&cmd, "ZCARD");
     redis_vtbl_command_arg_fmt(&cmd, "%s.index.rowid", vtab->key_base);
-    redis_vtbl_command_arg(&cmd, "0");
-    redis_vtbl_command_arg(&cmd, "-1");
-    reply = redis_vtbl_connection_command(&vtab->conn, &cmd);
+    reply = redis_vtbl_connection_command(cursor->conn, &cmd);
     if(!reply) return SQLITE_ERROR;
     
-    err = redis_reply_numeric_array(&cursor->rows, reply);
+    if(reply->type != REDIS_REPLY_INTEGER) {
+        freeReplyObject(reply);
+        return SQLITE_ERROR;
+    }
+    cursor->count = reply->integer - cursor->skip;
     freeReplyObject(reply);
     
-    if(err) return SQLITE_ERROR;
+    if(cursor->count < 0) cursor->count = 0;
+    if(cursor->limit >= 0 && cursor->limit < cursor->count) cursor->count = cursor->limit;
+    cursor->count_pos = 0;
+    cursor->counting = 1;
+    
     return SQLITE_OK;
 }
+/* The rowid of a counted row is requested; page in the remaining rowids from the current position */
+static int redis_vtbl_cursor_uncount(redis_vtbl_cursor *cursor) {
+    cursor->counting = 0;
+    cursor->skip += cursor->count_pos;
+    cursor->limit = cursor->count - cursor->count_pos;
+    
+    return redis_vtbl_cursor_filter_scan(cursor, "-inf", "+inf");
+}
+/* Walk the index of the given column in value order */
+static int redis_vtbl_cursor_filter_ordered(redis_vtbl_cursor *cursor, int index) {
+    if(index < 0) return SQLITE_ERROR;
+    
+    cursor->scan_index = index;
+    cursor->scan_offset = 0;
+    cursor->scan = 1;
+    
+    return redis_vtbl_cursor_scan_page(cursor);
+}
 static int redis_vtbl_cursor_filter_rowid(redis_vtbl_cursor *cursor, sqlite3_int64 row_id, int idxNum) {
-    int err;
     redis_vtbl_vtab *vtab;
     redis_vtbl_command cmd;
     redisReply *reply;
+    char bound[32];
 
     vtab = cursor->vtab;
 
     switch(idxNum) {
-        case CURSOR_INDEX_ROWID_EQ:
-            redis_vtbl_command_init_arg(&cmd, "EXISTS");
-            redis_vtbl_command_arg_fmt(&cmd, "%s:%lld", vtab->key_base, row_id);
-            reply = redis_vtbl_connection_command(&vtab->conn, &cmd);
-            break;
         case CURSOR_INDEX_ROWID_GT:
-            redis_vtbl_command_init_arg(&cmd, "ZRANGEBYSCORE");
-            redis_vtbl_command_arg_fmt(&cmd, "%s.index.rowid", vtab->key_base);
-            redis_vtbl_command_arg_fmt(&cmd, "(%lld", row_id);
-            redis_vtbl_command_arg(&cmd, "+inf");
-            reply = redis_vtbl_connection_command(&vtab->conn, &cmd);
-            break;
+            snprintf(bound, sizeof(bound), "(%lld", row_id);
+            return redis_vtbl_cursor_filter_scan(cursor, bound, "+inf");
         case CURSOR_INDEX_ROWID_LT:
-            redis_vtbl_command_init_arg(&cmd, "ZRANGEBYSCORE");
-            redis_vtbl_command_arg_fmt(&cmd, "%s.index.rowid", vtab->key_base);
-            redis_vtbl_command_arg(&cmd, "-inf");
-            redis_vtbl_command_arg_fmt(&cmd, "(%lld", row_id);
-            reply = redis_vtbl_connection_command(&vtab->conn, &cmd);
-            break;
+            snprintf(bound, sizeof(bound), "(%lld", row_id);
+            return redis_vtbl_cursor_filter_scan(cursor, "-inf", bound);
         case CURSOR_INDEX_ROWID_GE:
-            redis_vtbl_command_init_arg(&cmd, "ZRANGEBYSCORE");
-            redis_vtbl_command_arg_fmt(&cmd, "%s.index.rowid", vtab->key_base);
-            redis_vtbl_command_arg_fmt(&cmd, "%lld", row_id);
-            redis_vtbl_command_arg(&cmd, "+inf");
-            reply = redis_vtbl_connection_command(&vtab->conn, &cmd);
-            break;
+            snprintf(bound, sizeof(bound), "%lld", row_id);
+            return redis_vtbl_cursor_filter_scan(cursor, bound, "+inf");
         case CURSOR_INDEX_ROWID_LE:
-            redis_vtbl_command_init_arg(&cmd, "ZRANGEBYSCORE");
-            redis_vtbl_command_arg_fmt(&cmd, "%s.index.rowid", vtab->key_base);
-            redis_vtbl_command_arg(&cmd, "-inf");
-            redis_vtbl_command_arg_fmt(&cmd, "%lld", row_id);
-            reply = redis_vtbl_connection_command(&vtab->conn, &cmd);
-            break;
+            snprintf(bound, sizeof(bound), "%lld", row_id);
+            return redis_vtbl_cursor_filter_scan(cursor, "-inf", bound);
     }
-
-    if(!reply) return SQLITE_ERROR;
     
-    if(idxNum == CURSOR_INDEX_ROWID_EQ) {
-        if(reply->type == REDIS_REPLY_INTEGER) {
-            if(reply->integer) vector_push(&cursor->rows, &row_id);
-            
-        } else {
-            freeReplyObject(reply);
-            return SQLITE_ERROR;
-        }
-        freeReplyObject(reply);
+    /* CURSOR_INDEX_ROWID_EQ; the rowid index rather than the row so a row being truncated is gone */
+    redis_vtbl_command_init_arg(&cmd, "ZSCORE");
+    redis_vtbl_command_arg_fmt(&cmd, "%s.index.rowid", vtab->key_base);
+    redis_vtbl_command_arg_fmt(&cmd, "%lld", row_id);
+    reply = redis_vtbl_connection_command(cursor->conn, &cmd);
+    if(!reply) return SQLITE_ERROR;
     
+    if(reply->type == REDIS_REPLY_STRING || reply->type == REDIS_REPLY_NIL) {
+        if(reply->type == REDIS_REPLY_STRING) vector_push(&cursor->rows, &row_id);
+        
     } else {
-        err = redis_reply_numeric_array(&cursor->rows, reply);
         freeReplyObject(reply);
-        if(err) return SQLITE_ERROR;
+        return SQLITE_ERROR;
     }
+    freeReplyObject(reply);
     
     return SQLITE_OK;
 }
-static int redis_vtbl_cursor_filter_index_text(redis_vtbl_cursor *cursor, int idxNum, const char *idxStr, const char *value);
-static int redis_vtbl_cursor_filter_index_integer(redis_vtbl_cursor *cursor, int idxNum, const char *idxStr, sqlite3_int64 value);
-static int redis_vtbl_cursor_filter_index_float(redis_vtbl_cursor *cursor, int idxNum, const char *idxStr, double value);
-static int redis_vtbl_cursor_filter_index(redis_vtbl_cursor *cursor, int idxNum, const char *idxStr, sqlite3_value *value) {
-    int err;
-    redis_vtbl_vtab *vtab;
-    redis_vtbl_column_spec *cspec;
-    
-    vtab = cursor->vtab;
+/* Resolve the indexed constraints to rowids; the result is their intersection.
+ * The script only reads so it may be evaluated against a replica.
+ * ARGV[1]  key_base
+ * ARGV[2]  asc | desc | none rowid order
+ * ARGV[3]  rowids to skip
+ * ARGV[4]  rowids to return; -1 unlimited
+ * ARGV[5...] column, kind, n, n args for each constraint where kind is
+ *      eq      the rowids of a single value
+ *      in      the union of the rowids of each value
+ *      score   the union of the rowids of each value with score in any of the min, max pairs
+ *      lex     the union of the rowids of each value within any of the min, max pairs (ZRANGEBYLEX bounds)
+ * Returns the matching rowids. */
+static const char redis_vtbl_script_lookup[] = "\
+    local key_base = ARGV[1];\n\
+    local eq = {};\n\
+    local unions = {};\n\
+    local t = 5;\n\
+    while t <= #ARGV do\n\
+        local index = key_base..'.index:'..ARGV[t];\n\
+        local kind, n = ARGV[t+1], tonumber(ARGV[t+2]);\n\
+        if kind == 'eq' then\n\
+            eq[#eq+1] = index..':'..ARGV[t+3];\n\
+        else\n\
+            local values = {};\n\
+            if kind == 'score' or kind == 'lex' then\n\
+                local range = kind == 'score' and 'ZRANGEBYSCORE' or 'ZRANGEBYLEX';\n\
+                for i = 1, n, 2 do\n\
+                    local members = redis.call(range, index, ARGV[t+2+i], ARGV[t+3+i]);\n\
+                    for _,value in ipairs(members) do values[#values+1] = value end\n\
+                end\n\
+            else\n\
+                for i = 1, n do values[i] = ARGV[t+2+i] end\n\
+            end\n\
+            local keys = {};\n\
+            for i,value in ipairs(values) do keys[i] = index..':'..value end\n\
+            unions[#unions+1] = keys;\n\
+        end\n\
+        t = t + 3 + n;\n\
+    end\n\
+    \n\
+    local rows = nil;\n\
+    if #eq > 0 then\n\
+        rows = {};\n\
+        for _,row_id in ipairs(redis.call('SINTER', unpack(eq))) do rows[row_id] = true end\n\
+    end\n\
+    for _,keys in ipairs(unions) do\n\
+        if rows and next(rows) == nil then break end\n\
+        local found = {};\n\
+        for k = 1, #keys, 1000 do\n\
+            local members = redis.call('SUNION', unpack(keys, k, math.min(k+999, #keys)));\n\
+            for _,row_id in ipairs(members) do\n\
+                if not rows or rows[row_id] then found[row_id] = true end\n\
+            end\n\
+        end\n\
+        rows = found;\n\
+    end\n\
+    \n\
+    local result = {};\n\
+    local truncating = redis.call('EXISTS', key_base..'.truncate.rowid') == 1;\n\
+    for row_id in pairs(rows or {}) do\n\
+        if not truncating or redis.call('ZSCORE', key_base..'.index.rowid', row_id) then result[#result+1] = row_id end\n\
+    end\n\
+    if ARGV[2] == 'asc' then\n\
+        table.sort(result, function(l, r) return tonumber(l) < tonumber(r) end);\n\
+    elseif ARGV[2] == 'desc' then\n\
+        table.sort(result, function(l, r) return tonumber(l) > tonumber(r) end);\n\
+    end\n\
+    \n\
+    local skip, count = tonumber(ARGV[3]), tonumber(ARGV[4]);\n\
+    if skip == 0 and count < 0 then return result end\n\
+    local window = {};\n\
+    for i = skip + 1, #result do\n\
+        if #window == count then break end\n\
+        window[#window+1] = result[i];\n\
+    end\n\
+    return window;\n";
+
+/* Score range of a numeric index constraint. Returns 0 if the constraint can never be satisfied. */
+static int redis_vtbl_lookup_bounds(int op, sqlite3_value *value, char *min, char *max, size_t size) {
+    char bound[32];
+    
+    switch(sqlite3_value_numeric_type(value)) {
+        case SQLITE_INTEGER:
+            snprintf(bound, sizeof(bound), "%lld", sqlite3_value_int64(value));
+            break;
+        case SQLITE_FLOAT:
+            snprintf(bound, sizeof(bound), "%.17g", sqlite3_value_double(value));
+            break;
+        default:
+            /* sqlite orders numbers before text */
+            if(op == SQLITE_INDEX_CONSTRAINT_LT || op == SQLITE_INDEX_CONSTRAINT_LE) {
+                snprintf(min, size, "-inf");
+                snprintf(max, size, "+inf");
+                return 1;
+            }
+            return 0;
+    }
     
-    cspec = vector_find(&vtab->columns, idxStr, (int (*)(const void *, const void *))redis_vtbl_column_spec_name_cmp);
-    if(!cspec) return SQLITE_ERROR;
-
-    err = SQLITE_ERROR;
-
-    switch(cspec->data_type) {
-        case SQLITE_INTEGER: {
-            sqlite3_int64 ivalue;
-            
-            ivalue = sqlite3_value_int64(value);
-            err = redis_vtbl_cursor_filter_index_integer(cursor, idxNum, idxStr, ivalue);
+    snprintf(min, size, "-inf");
+    snprintf(max, size, "+inf");
+    switch(op) {
+        case SQLITE_INDEX_CONSTRAINT_EQ:
+            snprintf(min, size, "%s", bound);
+            snprintf(max, size, "%s", bound);
             break;
-        }
-        
-        case SQLITE_TEXT: {
-            const char *cvalue;
-            
-            cvalue = (const char*)sqlite3_value_text(value);
-            err = redis_vtbl_cursor_filter_index_text(cursor, idxNum, idxStr, cvalue);
+        case SQLITE_INDEX_CONSTRAINT_GT:
+            snprintf(min, size, "(%s", bound);
             break;
-        }
-        
-        case SQLITE_FLOAT: {
-            double fvalue;
-            
-            fvalue = sqlite3_value_double(value);
-            err = redis_vtbl_cursor_filter_index_float(cursor, idxNum, idxStr, fvalue);
+        case SQLITE_INDEX_CONSTRAINT_GE:
+            snprintf(min, size, "%s", bound);
+            break;
+        case SQLITE_INDEX_CONSTRAINT_LT:
+            snprintf(max, size, "(%s", bound);
+            break;
+        case SQLITE_INDEX_CONSTRAINT_LE:
+            snprintf(max, size, "%s", bound);
             break;
-        }
     }
-    
-    return err;
+    return 1;
 }
-static int redis_vtbl_cursor_filter_index_text(redis_vtbl_cursor *cursor, int idxNum, const char *idxStr, const char *value) {
-    int err;
-    redis_vtbl_vtab *vtab;
-    redis_vtbl_command cmd;
-    redisReply *reply;
-    long long rank;
-    
-    vtab = cursor->vtab;
-    
-    redis_vtbl_command_init_arg(&cmd, "ZRANK");
-    redis_vtbl_command_arg_fmt(&cmd, "%s.index:%s", vtab->key_base, idxStr);
-    redis_vtbl_command_arg_fmt(&cmd, "%s", value);
-    reply = redis_vtbl_connection_command(&vtab->conn, &cmd);
-    if(reply->type == REDIS_REPLY_INTEGER) {
-        rank = reply->integer;
-    
-    } else if(reply->type == REDIS_REPLY_NIL) {
-        rank = -1;
+/* Lexicographic range of a text index constraint; members are ordered bytewise i.e. BINARY collation.
+ * GLOB is ranged by the literal prefix of the pattern. */
+static int redis_vtbl_lookup_lex(redis_vtbl_command *cmd, int op, sqlite3_value *value) {
+    const char *text;
+    char *upper;
+    size_t n;
     
-    } else {
-        freeReplyObject(reply);
-        return SQLITE_ERROR;
-    }
-    freeReplyObject(reply);
-
-    if(idxNum == CURSOR_INDEX_NAMED_EQ) {
-        if(rank == -1) return SQLITE_OK;    /* rank indicates item does not exist. */
-        redis_vtbl_command_init_arg(&cmd, "SMEMBERS");
-        redis_vtbl_command_arg_fmt(&cmd, "%s.index:%s:%s", vtab->key_base, idxStr, value);
-        reply = redis_vtbl_connection_command(&vtab->conn, &cmd);
-    
-    } else if(rank == -1) {
-        /* todo fallback to a scan if the value does not exist in the index.
-         * This can be improved by determining the approximate rank of the item
-         * and then using zrange more efficiently. */
-        redis_vtbl_command_init_arg(&cmd, "ZRANGE");
-        redis_vtbl_command_arg_fmt(&cmd, "%s.index:%s", vtab->key_base, idxStr);
-        redis_vtbl_command_arg(&cmd, "0");
-        redis_vtbl_command_arg(&cmd, "-1");
-        reply = redis_vtbl_connection_command(&vtab->conn, &cmd);
+    text = (const char*)sqlite3_value_text(value);
+    if(!text) return SQLITE_NOMEM;
     
-    } else {
-        switch(idxNum) {
-            case CURSOR_INDEX_NAMED_GT:
-                redis_vtbl_command_init_arg(&cmd, "ZRANGE");
-                redis_vtbl_command_arg_fmt(&cmd, "%s.index:%s", vtab->key_base, idxStr);
-                redis_vtbl_command_arg_fmt(&cmd, "%lld", rank);
-                redis_vtbl_command_arg(&cmd, "-1");
-                reply = redis_vtbl_connection_command(&vtab->conn, &cmd);
-                break;
-            case CURSOR_INDEX_NAMED_LT:
-                redis_vtbl_command_init_arg(&cmd, "ZRANGE");
-                redis_vtbl_command_arg_fmt(&cmd, "%s.index:%s", vtab->key_base, idxStr);
-                redis_vtbl_command_arg(&cmd, "0");
-                redis_vtbl_command_arg_fmt(&cmd, "%lld", rank);
-                reply = redis_vtbl_connection_command(&vtab->conn, &cmd);
-                break;
-            case CURSOR_INDEX_NAMED_GE:
-                redis_vtbl_command_init_arg(&cmd, "ZRANGE");
-                redis_vtbl_command_arg_fmt(&cmd, "%s.index:%s", vtab->key_base, idxStr);
-                redis_vtbl_command_arg_fmt(&cmd, "%lld", rank);
-                redis_vtbl_command_arg(&cmd, "-1");
-                reply = redis_vtbl_connection_command(&vtab->conn, &cmd);
+    redis_vtbl_command_arg(cmd, "lex");
+    redis_vtbl_command_arg(cmd, "2");
+    switch(op) {
+        case SQLITE_INDEX_CONSTRAINT_GT:
+            redis_vtbl_command_arg_fmt(cmd, "(%s", text);
+            redis_vtbl_command_arg(cmd, "+");
+            break;
+        case SQLITE_INDEX_CONSTRAINT_GE:
+            redis_vtbl_command_arg_fmt(cmd, "[%s", text);
+            redis_vtbl_command_arg(cmd, "+");
+            break;
+        case SQLITE_INDEX_CONSTRAINT_LT:
+            redis_vtbl_command_arg(cmd, "-");
+            redis_vtbl_command_arg_fmt(cmd, "(%s", text);
+            break;
+        case SQLITE_INDEX_CONSTRAINT_LE:
+            redis_vtbl_command_arg(cmd, "-");
+            redis_vtbl_command_arg_fmt(cmd, "[%s", text);
+            break;
+        case SQLITE_INDEX_CONSTRAINT_GLOB:
+            n = strcspn(text, "*?[");
+            if(n == 0) {
+                redis_vtbl_command_arg(cmd, "-");
+                redis_vtbl_command_arg(cmd, "+");
                 break;
-            case CURSOR_INDEX_NAMED_LE:
-                redis_vtbl_command_init_arg(&cmd, "ZRANGE");
-                redis_vtbl_command_arg_fmt(&cmd, "%s.index:%s", vtab->key_base, idxStr);
-                redis_vtbl_command_arg(&cmd, "0");
-                redis_vtbl_command_arg_fmt(&cmd, "%lld", rank);
-                reply = redis_vtbl_connection_command(&vtab->conn, &cmd);
+            }
+            redis_vtbl_command_arg_fmt(cmd, "[%.*s", (int)n, text);
+            
+            /* below the prefix with its last byte incremented */
+            while(n && (unsigned char)text[n - 1] == 0xFF) --n;
+            if(n == 0) {
+                redis_vtbl_command_arg(cmd, "+");
                 break;
-        }
+            }
+            upper = malloc(n + 2);
+            if(!upper) return SQLITE_NOMEM;
+            upper[0] = '(';
+            memcpy(upper + 1, text, n);
+            ++upper[n];
+            upper[n + 1] = 0;
+            redis_vtbl_command_arg(cmd, upper);
+            free(upper);
+            break;
+        default:
+            return SQLITE_ERROR;
     }
-
-    if(!reply) return SQLITE_ERROR;
-
-    err = redis_reply_numeric_array(&cursor->rows, reply);
-    freeReplyObject(reply);
-    if(err) return SQLITE_ERROR;
-    
     return SQLITE_OK;
 }
-static int redis_vtbl_cursor_filter_index_integer(redis_vtbl_cursor *cursor, int idxNum, const char *idxStr, sqlite3_int64 value) {
-    int err;
-    redis_vtbl_vtab *vtab;
-    redis_vtbl_command cmd;
-    redisReply *reply;
+#if SQLITE_VERSION_NUMBER >= 3038000
+/* Append an IN list as a single lookup term; the script unions the rowids of every value. */
+static int redis_vtbl_lookup_in(redis_vtbl_command *cmd, redis_vtbl_column_spec *cspec, sqlite3_value *in) {
+    int rc;
+    sqlite3_value *value;
+    list_t args;
+    size_t i;
+    char min[34];
+    char max[34];
     
-    vtab = cursor->vtab;
-
-    switch(idxNum) {
-        case CURSOR_INDEX_NAMED_EQ:
-            redis_vtbl_command_init_arg(&cmd, "SMEMBERS");
-            redis_vtbl_command_arg_fmt(&cmd, "%s.index:%s:%lld", vtab->key_base, idxStr, value);
-            reply = redis_vtbl_connection_command(&vtab->conn, &cmd);
-            break;
+    list_init(&args, free);
+    for(rc = sqlite3_vtab_in_first(in, &value); rc == SQLITE_OK && value; rc = sqlite3_vtab_in_next(in, &value)) {
+        if(sqlite3_value_type(value) == SQLITE_NULL) continue;         /* never equal */
         
-        case CURSOR_INDEX_NAMED_GT:
-            redis_vtbl_command_init_arg(&cmd, "ZRANGEBYSCORE");
-            redis_vtbl_command_arg_fmt(&cmd, "%s.index:%s", vtab->key_base, idxStr);
-            redis_vtbl_command_arg_fmt(&cmd, "(%lld", value);
-            redis_vtbl_command_arg(&cmd, "+inf");
-            reply = redis_vtbl_connection_command(&vtab->conn, &cmd);
-            break;
-        case CURSOR_INDEX_NAMED_LT:
-            redis_vtbl_command_init_arg(&cmd, "ZRANGEBYSCORE");
-            redis_vtbl_command_arg_fmt(&cmd, "%s.index:%s", vtab->key_base, idxStr);
-            redis_vtbl_command_arg(&cmd, "-inf");
-            redis_vtbl_command_arg_fmt(&cmd, "(%lld", value);
-            reply = redis_vtbl_connection_command(&vtab->conn, &cmd);
-            break;
-        case CURSOR_INDEX_NAMED_GE:
-            redis_vtbl_command_init_arg(&cmd, "ZRANGEBYSCORE");
-            redis_vtbl_command_arg_fmt(&cmd, "%s.index:%s", vtab->key_base, idxStr);
-            redis_vtbl_command_arg_fmt(&cmd, "%lld", value);
-            redis_vtbl_command_arg(&cmd, "+inf");
-            reply = redis_vtbl_connection_command(&vtab->conn, &cmd);
-            break;
-        case CURSOR_INDEX_NAMED_LE:
-            redis_vtbl_command_init_arg(&cmd, "ZRANGEBYSCORE");
-            redis_vtbl_command_arg_fmt(&cmd, "%s.index:%s", vtab->key_base, idxStr);
-            redis_vtbl_command_arg(&cmd, "-inf");
-            redis_vtbl_command_arg_fmt(&cmd, "%lld", value);
-            reply = redis_vtbl_connection_command(&vtab->conn, &cmd);
-            break;
+        if(cspec->data_type == SQLITE_TEXT) {
+            if(list_push(&args, strdup((const char*)sqlite3_value_text(value)))) rc = SQLITE_NOMEM;
+        } else {
+            if(!redis_vtbl_lookup_bounds(SQLITE_INDEX_CONSTRAINT_EQ, value, min, max, sizeof(min))) continue;
+            if(list_push(&args, strdup(min)) || list_push(&args, strdup(max))) rc = SQLITE_NOMEM;
+        }
+        if(rc != SQLITE_OK) break;
+    }
+    if(rc != SQLITE_DONE) {
+        list_free(&args);
+        return rc;
     }
     
-    if(!reply) return SQLITE_ERROR;
-    
-    err = redis_reply_numeric_array(&cursor->rows, reply);
-    freeReplyObject(reply);
-    if(err) return SQLITE_ERROR;
+    redis_vtbl_command_arg(cmd, cspec->name);
+    redis_vtbl_command_arg(cmd, cspec->data_type == SQLITE_TEXT ? "in" : "score");
+    redis_vtbl_command_arg_fmt(cmd, "%d", (int)args.size);
+    for(i = 0; i < args.size; ++i)
+        redis_vtbl_command_arg(cmd, list_get(&args, i));
+    list_free(&args);
     
     return SQLITE_OK;
 }
-static int redis_vtbl_cursor_filter_index_float(redis_vtbl_cursor *cursor, int idxNum, const char *idxStr, double value) {
+#endif
+static int redis_vtbl_cursor_filter_lookup(redis_vtbl_cursor *cursor, redis_vtbl_plan *plan, int argc, sqlite3_value **argv) {
     int err;
     redis_vtbl_vtab *vtab;
     redis_vtbl_command cmd;
     redisReply *reply;
+    redis_vtbl_plan_term *term;
+    redis_vtbl_column_spec *cspec;
+    size_t i;
+    char min[34];
+    char max[34];
     
     vtab = cursor->vtab;
-
-    switch(idxNum) {
-        case CURSOR_INDEX_NAMED_EQ:
-            redis_vtbl_command_init_arg(&cmd, "SMEMBERS");
-            redis_vtbl_command_arg_fmt(&cmd, "%s.index:%s:%f", vtab->key_base, idxStr, value);
-            reply = redis_vtbl_connection_command(&vtab->conn, &cmd);
-            break;
+    if((size_t)argc < plan->lookup.size) return SQLITE_ERROR;
+    
+    redis_vtbl_command_init_arg(&cmd, "0");
+    redis_vtbl_command_arg(&cmd, vtab->key_base);
+    redis_vtbl_command_arg(&cmd, plan->order ? (plan->order > 0 ? "asc" : "desc") : "none");
+    redis_vtbl_command_arg_fmt(&cmd, "%lld", cursor->skip);
+    redis_vtbl_command_arg_fmt(&cmd, "%lld", cursor->limit);
+    
+    for(i = 0; i < plan->lookup.size; ++i) {
+        term = vector_get(&plan->lookup, i);
         
-        case CURSOR_INDEX_NAMED_GT:
-            redis_vtbl_command_init_arg(&cmd, "ZRANGEBYSCORE");
-            redis_vtbl_command_arg_fmt(&cmd, "%s.index:%s", vtab->key_base, idxStr);
-            redis_vtbl_command_arg_fmt(&cmd, "(%f", value);
-            redis_vtbl_command_arg(&cmd, "+inf");
-            reply = redis_vtbl_connection_command(&vtab->conn, &cmd);
-            break;
-        case CURSOR_INDEX_NAMED_LT:
-            redis_vtbl_command_init_arg(&cmd, "ZRANGEBYSCORE");
-            redis_vtbl_command_arg_fmt(&cmd, "%s.index:%s", vtab->key_base, idxStr);
-            redis_vtbl_command_arg(&cmd, "-inf");
-            redis_vtbl_command_arg_fmt(&cmd, "(%f", value);
-            reply = redis_vtbl_connection_command(&vtab->conn, &cmd);
-            break;
-        case CURSOR_INDEX_NAMED_GE:
-            redis_vtbl_command_init_arg(&cmd, "ZRANGEBYSCORE");
-            redis_vtbl_command_arg_fmt(&cmd, "%s.index:%s", vtab->key_base, idxStr);
-            redis_vtbl_command_arg_fmt(&cmd, "%f", value);
-            redis_vtbl_command_arg(&cmd, "+inf");
-            reply = redis_vtbl_connection_command(&vtab->conn, &cmd);
-            break;
-        case CURSOR_INDEX_NAMED_LE:
-            redis_vtbl_command_init_arg(&cmd, "ZRANGEBYSCORE");
-            redis_vtbl_command_arg_fmt(&cmd, "%s.index:%s", vtab->key_base, idxStr);
-            redis_vtbl_command_arg(&cmd, "-inf");
-            redis_vtbl_command_arg_fmt(&cmd, "%f", value);
-            reply = redis_vtbl_connection_command(&vtab->conn, &cmd);
-            break;
+        cspec = vector_get(&vtab->columns, term->column);
+        if(!cspec) {
+            redis_vtbl_command_free(&cmd);
+            return SQLITE_ERROR;
+        }
+        
+#if SQLITE_VERSION_NUMBER >= 3038000
+        if(term->op == PLAN_OP_IN) {          /* only planned for sqlite 3.38 or later */
+            err = redis_vtbl_lookup_in(&cmd, cspec, argv[i]);
+            if(err) {
+                redis_vtbl_command_free(&cmd);
+                return err;
+            }
+            continue;
+        }
+#endif
+        
+        /* comparison with null is never true */
+        if(sqlite3_value_type(argv[i]) == SQLITE_NULL) {
+            redis_vtbl_command_free(&cmd);
+            return SQLITE_OK;
+        }
+        
+        redis_vtbl_command_arg(&cmd, cspec->name);
+        if(cspec->data_type == SQLITE_TEXT && term->op == SQLITE_INDEX_CONSTRAINT_EQ) {
+            redis_vtbl_command_arg(&cmd, "eq");
+            redis_vtbl_command_arg(&cmd, "1");
+            redis_vtbl_command_arg(&cmd, (const char*)sqlite3_value_text(argv[i]));
+        } else if(cspec->data_type == SQLITE_TEXT) {
+            err = redis_vtbl_lookup_lex(&cmd, term->op, argv[i]);
+            if(err) {
+                redis_vtbl_command_free(&cmd);
+                return err;
+            }
+        } else {
+            /* numeric values are matched by score; 1, 1.0 and 1e0 are equal */
+            if(!redis_vtbl_lookup_bounds(term->op, argv[i], min, max, sizeof(min))) {
+                redis_vtbl_command_free(&cmd);
+                return SQLITE_OK;
+            }
+            redis_vtbl_command_arg(&cmd, "score");
+            redis_vtbl_command_arg(&cmd, "2");
+            redis_vtbl_command_arg(&cmd, min);
+            redis_vtbl_command_arg(&cmd, max);
+        }
     }
     
+    reply = redis_vtbl_connection_eval(cursor->conn, redis_vtbl_script_lookup, &cmd);
     if(!reply) return SQLITE_ERROR;
     
     err = redis_reply_numeric_array(&cursor->rows, reply);
@@ -1344,9 +3068,17 @@ static int redis_vtbl_cursor_next(sqlite3_vtab_cursor *pCursor) {
     redis_vtbl_cursor *cursor;
     
     cursor = (redis_vtbl_cursor*)pCursor;
+    if(cursor->counting) {
+        ++cursor->count_pos;
+        return SQLITE_OK;
+    }
+    
     ++cursor->current_row;
     cursor->column_data_valid = 0;
     
+    if(cursor->current_row == vector_end(&cursor->rows) && cursor->scan)
+        return redis_vtbl_cursor_scan_page(cursor);
+    
     return SQLITE_OK;
 }
 
@@ -1354,6 +3086,8 @@ static int redis_vtbl_cursor_eof(sqlite3_vtab_cursor *pCursor) {
     redis_vtbl_cursor *cursor;
     cursor = (redis_vtbl_cursor*)pCursor;
     
+    if(cursor->counting)
+        return cursor->count_pos >= cursor->count;
     return cursor->current_row == vector_end(&cursor->rows);
 }
 
@@ -1361,7 +3095,7 @@ static int redis_vtbl_cursor_column(sqlite3_vtab_cursor *pCursor, sqlite3_contex
     redis_vtbl_cursor *cursor;
     redis_vtbl_vtab *vtab;
     redis_vtbl_column_spec *cspec;
-    const char *value;
+    redisReply *value;
     char *end;
     sqlite3_int64 i;
     double f;
@@ -1372,6 +3106,11 @@ static int redis_vtbl_cursor_column(sqlite3_vtab_cursor *pCursor, sqlite3_contex
     cspec = vector_get(&vtab->columns, N);
     if(!cspec) return SQLITE_ERROR;
 
+#if SQLITE_VERSION_NUMBER >= 3022000
+    if(sqlite3_libversion_number() >= 3022000 && sqlite3_vtab_nochange(ctx))
+        return SQLITE_OK;           /* column is not changed by the UPDATE; leave it unfetched */
+#endif
+
     if(!cursor->column_data_valid) {
         redis_vtbl_cursor_get(cursor);
     }
@@ -1385,19 +3124,23 @@ static int redis_vtbl_cursor_column(sqlite3_vtab_cursor *pCursor, sqlite3_contex
     switch(cspec->data_type) {
         case SQLITE_INTEGER:
             errno = 0;
-            i = strtoll(value, &end, 10);
+            i = strtoll(value->str, &end, 10);
             if(errno || *end)      /* out-of-range | rubbish characters */
                 break;
             sqlite3_result_int64(ctx, i);
             break;
             
         case SQLITE_TEXT:
-            sqlite3_result_text(ctx, value, -1, SQLITE_TRANSIENT);
+            sqlite3_result_text(ctx, value->str, value->len, SQLITE_TRANSIENT);
+            break;
+            
+        case SQLITE_BLOB:
+            sqlite3_result_blob(ctx, value->str, value->len, SQLITE_TRANSIENT);
             break;
             
         case SQLITE_FLOAT:
             errno = 0;
-            f = strtod(value, &end);
+            f = strtod(value->str, &end);
             if(errno || *end)      /* out-of-range | rubbish characters */
                 break;
             sqlite3_result_double(ctx, f);
@@ -1411,7 +3154,9 @@ static int redis_vtbl_cursor_rowid(sqlite3_vtab_cursor *pCursor, sqlite3_int64 *
     redis_vtbl_cursor *cursor;
     cursor = (redis_vtbl_cursor*)pCursor;
     
-    if(!cursor->current_row) return SQLITE_ERROR;
+    if(cursor->counting && redis_vtbl_cursor_uncount(cursor))
+        return SQLITE_ERROR;
+    if(!cursor->current_row || cursor->current_row == vector_end(&cursor->rows)) return SQLITE_ERROR;
 
     *pRowid = *cursor->current_row;
     return SQLITE_OK;
@@ -1421,6 +3166,17 @@ static int redis_vtbl_cursor_rowid(sqlite3_vtab_cursor *pCursor, sqlite3_int64 *
  * sqlite3 extension machinery
  *----------------------------------------------------------------------------*/
 
+/* Scripts are loaded as soon as the connection is established */
+static void redis_vtbl_register_scripts(redis_vtbl_connection *conn) {
+    redis_vtbl_connection_script_register(conn, redis_vtbl_script_filter);
+    redis_vtbl_connection_script_register(conn, redis_vtbl_script_ordered);
+    redis_vtbl_connection_script_register(conn, redis_vtbl_script_lookup);
+    redis_vtbl_connection_script_register(conn, redis_vtbl_script_insert);
+    redis_vtbl_connection_script_register(conn, redis_vtbl_script_update);
+    redis_vtbl_connection_script_register(conn, redis_vtbl_script_delete);
+    redis_vtbl_connection_script_register(conn, redis_vtbl_script_truncate);
+}
+
 static const sqlite3_module redis_vtbl_Module = {
     .iVersion     = 1,
     
@@ -1431,6 +3187,10 @@ static const sqlite3_module redis_vtbl_Module = {
     .xUpdate       = redis_vtbl_update,
     .xDisconnect   = redis_vtbl_disconnect,
     .xDestroy      = redis_vtbl_destroy,
+    .xBegin        = redis_vtbl_begin,
+    .xSync         = redis_vtbl_sync,
+    .xCommit       = redis_vtbl_commit,
+    .xRollback     = redis_vtbl_rollback,
     
     .xOpen         = redis_vtbl_cursor_open,
     .xClose        = redis_vtbl_cursor_close,
@@ -8,135 +8,282 @@
 #include "sentinel.h"
 #include "address.h"
 #include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <poll.h>
 
-static int redisSentinelGetMasterAddress(redisContext *cs, const char *service, address_t* address);
-static int redisSentinelRefreshSentinelList(redisContext *cs, const char *service, vector_t *sentinels);
+static int redisSentinelMasterReply(redisReply *reply, address_t *address);
+static void redisSentinelRefreshSentinelList(redisReply *reply, vector_t *sentinels);
+static const char* redisSentinelField(redisReply *reply, const char *field);
 
 /* Sentinel client algorithm
  * track:
  *   no sentinel reachable -> error seninel down
  *   all null responses    -> master unknown
  *
- * for each sentinel address
- *   redisConnectWithTimeout(ip, port, short tv);
- *     fail -> continue
+ * if a master was found before
+ *   connect to it and confirm with ROLE that it is still master
+ *     ok -> return connected master context
+ * for all sentinel addresses at once (non-blocking, timeout overall)
+ *   connect
  *   SENTINEL get-master-addr-by-name master-name
- *     fail -> continue
- *   master ip:port received
- *   connect to master
- *     fail -> continue
- *   if sentinel not at head of list
- *     swap head, current
- *   return connected master context
- * return appropriate error code*/
+ *   SENTINEL sentinels master-name
+ * as answers arrive
+ *   count identical master ip:port answers
+ *   quorum reached -> stop waiting for the rest
+ * refresh the sentinel list from the deciding sentinel
+ * connect to master (via local_socket if given and the master is on this host)
+ * return connected master context or appropriate error code */
 
-int redisSentinelConnect(vector_t *sentinels, const char *service, redisContext **master_context) {
+typedef struct sentinel_probe {
+    redisContext *c;
+    int written;                /* commands fully sent */
+    redisReply *replies[2];     /* master address, sentinels */
+    int n;
+} sentinel_probe;
+
+typedef struct sentinel_answer {
+    address_t master;
+    int votes;
+    size_t probe;
+} sentinel_answer;
+
+static long long sentinel_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Connect to the master within timeout (ms; 0 none), via local_socket if it is on this host */
+static redisContext* redisSentinelMasterConnect(const address_t *master, const char *local_socket, long timeout) {
     redisContext *c = 0;
+    struct timeval tv;
+    
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = (timeout % 1000) * 1000;
     
+    if(local_socket && address_local_p(master)) {
+#ifndef QUIET
+        fprintf(stderr, "via unix:%s... ", local_socket);
+#endif
+        c = timeout ? redisConnectUnixWithTimeout(local_socket, tv) : redisConnectUnix(local_socket);
+        if(c && c->err) {
+            redisFree(c);
+            c = 0;                  /* fall back to tcp */
+        }
+    }
+    if(!c) c = timeout ? redisConnectWithTimeout(master->host, master->port, tv) : redisConnect(master->host, master->port);
+    if(c && c->err) {
+        redisFree(c);
+        c = 0;
+    }
+    return c;
+}
+
+/* The previous master, if it still is one */
+static redisContext* redisSentinelCachedMaster(const address_t *master, const char *local_socket, long timeout) {
+    redisContext *c;
+    redisReply *reply;
+    int ok;
+    
+    c = redisSentinelMasterConnect(master, local_socket, SENTINEL_PROBE_MS(timeout));
+    if(!c) return 0;
+    
+    reply = redisCommand(c, "ROLE");
+    ok = reply && reply->type == REDIS_REPLY_ARRAY && reply->elements > 0 &&
+            reply->element[0]->type == REDIS_REPLY_STRING && !strcmp(reply->element[0]->str, "master");
+    if(reply) freeReplyObject(reply);
+    if(!ok) {
+        redisFree(c);
+        return 0;
+    }
+    return c;
+}
+
+static void redisSentinelProbeFree(sentinel_probe *probe) {
+    int i;
+    for(i = 0; i < probe->n; ++i)
+        freeReplyObject(probe->replies[i]);
+    if(probe->c) redisFree(probe->c);
+}
+
+int redisSentinelConnect(vector_t *sentinels, const char *service, const char *local_socket, long timeout, int quorum, address_t *master, redisContext **master_context) {
     size_t i;
-    struct timeval tv;
+    size_t n;
+    sentinel_probe *probes;
+    struct pollfd *pfds;
+    size_t *pfd_probe;
+    size_t npfd;
+    vector_t answers;
+    sentinel_answer *answer;
+    sentinel_answer *decided;
+    long long deadline;
+    long long now;
+    size_t pending;
     
     int sentinels_reached = 0;
     int name_unknown = 0;
     int master_unknown = 0;
     
-    tv.tv_sec = 0;
-    tv.tv_usec = 250000;        /* 250ms */
-    
     *master_context = 0;
+    if(quorum < 1) quorum = 1;
     
-    for(i = 0; i < sentinels->size; ++i) {
-        int err;
-        address_t *sentinel = vector_get(sentinels, i);
-        redisContext *cs = 0;
-        address_t master;
-        
+    if(master && master->host[0]) {
 #ifndef QUIET
-        fprintf(stderr, "redis_vtbl: Connecting to sentinel %s:%d... ", sentinel->host, sentinel->port);
+        fprintf(stderr, "redis_vtbl: Connecting to last known master %s:%d... ", master->host, master->port);
 #endif
-        cs = redisConnectWithTimeout(sentinel->host, sentinel->port, tv);
-        if(!cs) return SENTINEL_ERROR;  /* oom */
-        if(cs->err) {
+        *master_context = redisSentinelCachedMaster(master, local_socket, timeout);
 #ifndef QUIET
-            fprintf(stderr, "-NOK %s\n", cs->errstr);
+        fprintf(stderr, *master_context ? "+OK\n" : "-NOK\n");
 #endif
-            redisFree(cs);
+        if(*master_context) return SENTINEL_OK;
+    }
+    
+    n = sentinels->size;
+    probes = calloc(n ? n : 1, sizeof(sentinel_probe));
+    pfds = calloc(n ? n : 1, sizeof(struct pollfd));
+    pfd_probe = calloc(n ? n : 1, sizeof(size_t));
+    if(!probes || !pfds || !pfd_probe) {
+        free(probes);
+        free(pfds);
+        free(pfd_probe);
+        return SENTINEL_ERROR;  /* oom */
+    }
+    vector_init(&answers, sizeof(sentinel_answer), 0);
+    
+    /* ask every sentinel at once */
+    pending = 0;
+    for(i = 0; i < n; ++i) {
+        address_t *sentinel = vector_get(sentinels, i);
+        
+        probes[i].c = redisConnectNonBlock(sentinel->host, sentinel->port);
+        if(!probes[i].c) continue;
+        if(probes[i].c->err) {
+            redisFree(probes[i].c);
+            probes[i].c = 0;
             continue;
         }
-#ifndef QUIET
-        fprintf(stderr, "+OK\n");
-#endif
+        redisAppendCommand(probes[i].c, "SENTINEL get-master-addr-by-name %s", service);
+        redisAppendCommand(probes[i].c, "SENTINEL sentinels %s", service);
+        ++pending;
+    }
+    
+    decided = 0;
+    deadline = sentinel_ms() + SENTINEL_PROBE_MS(timeout);
+    while(pending && !decided) {
+        now = sentinel_ms();
+        if(now >= deadline) break;
         
-        err = redisSentinelGetMasterAddress(cs, service, &master);
-        if(err) {
-            switch(err) {
-                case SENTINEL_ERROR:
-#ifndef QUIET
-                    fprintf(stderr, "redis_vtbl: Error; Next sentinel.\n");
-#endif
+        npfd = 0;
+        for(i = 0; i < n; ++i) {
+            if(!probes[i].c || probes[i].n == 2) continue;
+            pfds[npfd].fd = probes[i].c->fd;
+            pfds[npfd].events = probes[i].written ? POLLIN : POLLOUT;
+            pfds[npfd].revents = 0;
+            pfd_probe[npfd++] = i;
+        }
+        if(poll(pfds, npfd, (int)(deadline - now)) <= 0) break;
+        
+        for(i = 0; i < npfd && !decided; ++i) {
+            sentinel_probe *probe = &probes[pfd_probe[i]];
+            redisReply *reply;
+            address_t address;
+            int done;
+            int err;
+            
+            if(!pfds[i].revents) continue;
+            
+            err = 0;
+            if(!probe->written) {
+                /* connected; send the commands */
+                err = redisBufferWrite(probe->c, &done) != REDIS_OK;
+                if(!err && done) probe->written = 1;
+            } else {
+                err = redisBufferRead(probe->c) != REDIS_OK;
+                while(!err && probe->n < 2) {
+                    reply = 0;
+                    err = redisGetReplyFromReader(probe->c, (void**)&reply) != REDIS_OK;
+                    if(err || !reply) break;
+                    probe->replies[probe->n++] = reply;
+                }
+            }
+            if(err) {
+                redisFree(probe->c);
+                probe->c = 0;
+                --pending;
+                continue;
+            }
+            if(probe->n < 2) continue;
+            
+            /* answered */
+            --pending;
+            ++sentinels_reached;
+            switch(redisSentinelMasterReply(probe->replies[0], &address)) {
+                case SENTINEL_OK:
                     break;
-                
                 case SENTINEL_MASTER_NAME_UNKNOWN:
-#ifndef QUIET
-                    fprintf(stderr, "redis_vtbl: Master name unknown; Next sentinel.\n");
-#endif
                     ++name_unknown;
-                    break;
-                
+                    continue;
                 case SENTINEL_MASTER_UNKNOWN:
-#ifndef QUIET
-                    fprintf(stderr, "redis_vtbl: Master unknown; Next sentinel.\n");
-#endif
                     ++master_unknown;
-                    break;
+                    continue;
+                default:
+                    continue;
             }
-            redisFree(cs);
-            continue;
+            
+            answer = vector_find(&answers, &address, (int (*)(const void *, const void *))address_cmp);
+            if(!answer) {
+                sentinel_answer added;
+                added.master = address;
+                added.votes = 0;
+                added.probe = pfd_probe[i];
+                if(vector_push(&answers, &added)) continue;
+                answer = vector_get(&answers, answers.size - 1);
+            }
+            if(++answer->votes >= quorum) decided = answer;
         }
-        
+    }
+    
+    if(decided) {
 #ifndef QUIET
-        fprintf(stderr, "redis_vtbl: Found master %s:%d... ", master.host, master.port);
+        fprintf(stderr, "redis_vtbl: Found master %s:%d... ", decided->master.host, decided->master.port);
 #endif
+        /* Refresh the sentinel list from the deciding sentinel.
+         * This only appends to the end of the list; probes are indexed by position */
+        redisSentinelRefreshSentinelList(probes[decided->probe].replies[1], sentinels);
         
-        /* Refresh the sentinel list from the answering sentinel.
-         * This is safe because it only appends to the end of the list
-         * and no pointers to the list are maintained (only the index) */
-        redisSentinelRefreshSentinelList(cs, service, sentinels);
-        
-        redisFree(cs);
-        ++sentinels_reached;
-        
-        c = redisConnect(master.host, master.port);
-        address_free(&master);
-        
-        if(!c) return SENTINEL_ERROR;  /* oom */
-        if(c->err) {
-            redisFree(c);
-            c = 0;
-            continue;
-        }
-        
-        /* we are connected to master. */
-        *master_context = c;
-        break;
+        *master_context = redisSentinelMasterConnect(&decided->master, local_socket, timeout);
+#ifndef QUIET
+        fprintf(stderr, *master_context ? "+OK\n" : "-NOK\n");
+#endif
+        if(*master_context && master) *master = decided->master;
     }
     
+    for(i = 0; i < n; ++i)
+        redisSentinelProbeFree(&probes[i]);
+    free(probes);
+    free(pfds);
+    free(pfd_probe);
+    vector_free(&answers);
+    
     if(*master_context)    return SENTINEL_OK;
+    if(decided)            return SENTINEL_ERROR;   /* master unreachable */
     if(!sentinels_reached) return SENTINEL_UNREACHABLE;
     if(master_unknown)     return SENTINEL_MASTER_UNKNOWN;
     if(name_unknown)       return SENTINEL_MASTER_NAME_UNKNOWN;
     /* ... */              return SENTINEL_ERROR;
 }
 
-static int redisSentinelGetMasterAddress(redisContext *cs, const char *service, address_t* address) {
-    redisReply* reply;
+/* SENTINEL get-master-addr-by-name reply; an ip, port pair */
+static int redisSentinelMasterReply(redisReply *reply, address_t *address) {
     int err = SENTINEL_ERROR;
     
-    reply = redisCommand(cs, "SENTINEL get-master-addr-by-name %s", service);
-    if(!reply)
-        return SENTINEL_ERROR;
-    
-    if(reply->type == REDIS_REPLY_STRING) {
+    if(reply->type == REDIS_REPLY_ARRAY && reply->elements == 2 &&
+            reply->element[0]->type == REDIS_REPLY_STRING && reply->element[1]->type == REDIS_REPLY_STRING) {
+        err = address_init(address, reply->element[0]->str, atoi(reply->element[1]->str));
+        err = err || address->port <= 0 ? SENTINEL_ERROR : SENTINEL_OK;
+        
+    } else if(reply->type == REDIS_REPLY_STRING) {
         err = address_parse(address, reply->str, DEFAULT_REDIS_PORT);
         err = err ? SENTINEL_ERROR : SENTINEL_OK;
         
@@ -144,44 +291,103 @@ static int redisSentinelGetMasterAddress(redisContext *cs, const char *service,
         err = SENTINEL_MASTER_NAME_UNKNOWN;
         
     } else if (reply->type == REDIS_REPLY_ERROR) {
-        if(!strcmp(reply->str, "-IDONTKNOW"))
+        if(!strncmp(reply->str, "IDONTKNOW", 9) || !strncmp(reply->str, "-IDONTKNOW", 10))
             err = SENTINEL_MASTER_UNKNOWN;
     }
-    
-    freeReplyObject(reply);
     return err;
 }
 
-static int redisSentinelRefreshSentinelList(redisContext *cs, const char *service, vector_t *sentinels) {
-    redisReply* reply;
-    int err = SENTINEL_ERROR;
+/* SENTINEL sentinels reply; field / value pairs of each other sentinel */
+static void redisSentinelRefreshSentinelList(redisReply *reply, vector_t *sentinels) {
+    size_t i;
+    
+    if(reply->type != REDIS_REPLY_ARRAY) return;
     
-    reply = redisCommand(cs, "SENTINEL sentinels %s", service);
-    if(!reply)
-        return SENTINEL_ERROR;
-    
-    if(reply->type == REDIS_REPLY_ARRAY) {
-        size_t i;
-        for(i = 0; i < reply->elements; ++i) {
-            if(reply->element[i]->type == REDIS_REPLY_STRING) {
-                address_t *exists;
-                address_t sentinel;
-                
-                err = address_parse(&sentinel, reply->str, DEFAULT_REDIS_PORT);
-                if(err) continue;
-                
+    for(i = 0; i < reply->elements; ++i) {
+        const char *ip;
+        const char *port;
+        address_t sentinel;
+        
+        ip = redisSentinelField(reply->element[i], "ip");
+        port = redisSentinelField(reply->element[i], "port");
+        if(!ip || !port) continue;
+        if(address_init(&sentinel, ip, atoi(port)) || sentinel.port <= 0) continue;
+        
+        if(!vector_find(sentinels, &sentinel, (int (*)(const void *, const void *))address_cmp)) {
 #ifndef QUIET
-                fprintf(stderr, "redis_vtbl: Discovered seninel %s:%d... ", sentinel.host, sentinel.port);
+            fprintf(stderr, "redis_vtbl: Discovered sentinel %s:%d\n", sentinel.host, sentinel.port);
 #endif
-                
-                exists = vector_find(sentinels, &sentinel, (int (*)(const void *, const void *))address_cmp);
-                
-                if(!exists) vector_push(sentinels, &sentinel);
-            }
+            vector_push(sentinels, &sentinel);
         }
     }
+}
+
+/* The value of field in a reply of flat field / value pairs */
+static const char* redisSentinelField(redisReply *reply, const char *field) {
+    size_t i;
     
-    freeReplyObject(reply);
-    return err;
+    if(reply->type != REDIS_REPLY_ARRAY) return 0;
+    for(i = 0; i + 1 < reply->elements; i += 2) {
+        if(reply->element[i]->type == REDIS_REPLY_STRING && !strcmp(reply->element[i]->str, field))
+            return reply->element[i+1]->type == REDIS_REPLY_STRING ? reply->element[i+1]->str : 0;
+    }
+    return 0;
 }
 
+int redisSentinelReplicas(vector_t *sentinels, const char *service, long timeout, vector_t *replicas) {
+    size_t i;
+    size_t j;
+    struct timeval tv;
+    
+    tv.tv_sec = SENTINEL_PROBE_MS(timeout) / 1000;
+    tv.tv_usec = (SENTINEL_PROBE_MS(timeout) % 1000) * 1000;
+    
+    for(i = 0; i < sentinels->size; ++i) {
+        address_t *sentinel = vector_get(sentinels, i);
+        redisContext *cs;
+        redisReply *reply;
+        
+        cs = redisConnectWithTimeout(sentinel->host, sentinel->port, tv);
+        if(!cs) return SENTINEL_ERROR;  /* oom */
+        if(cs->err) {
+            redisFree(cs);
+            continue;
+        }
+        
+        /* SENTINEL slaves before redis 5 */
+        reply = redisCommand(cs, "SENTINEL replicas %s", service);
+        if(reply && reply->type == REDIS_REPLY_ERROR) {
+            freeReplyObject(reply);
+            reply = redisCommand(cs, "SENTINEL slaves %s", service);
+        }
+        redisFree(cs);
+        if(!reply) continue;
+        if(reply->type != REDIS_REPLY_ARRAY) {
+            freeReplyObject(reply);
+            continue;
+        }
+        
+        for(j = 0; j < reply->elements; ++j) {
+            const char *ip;
+            const char *port;
+            const char *flags;
+            address_t replica;
+            
+            ip = redisSentinelField(reply->element[j], "ip");
+            port = redisSentinelField(reply->element[j], "port");
+            flags = redisSentinelField(reply->element[j], "flags");
+            if(!ip || !port || !flags) continue;
+            if(strstr(flags, "s_down") || strstr(flags, "o_down") || strstr(flags, "disconnected")) continue;
+            
+            if(address_init(&replica, ip, atoi(port))) continue;
+            if(replica.port <= 0) continue;
+#ifndef QUIET
+            fprintf(stderr, "redis_vtbl: Discovered replica %s:%d\n", replica.host, replica.port);
+#endif
+            vector_push(replicas, &replica);
+        }
+        freeReplyObject(reply);
+        return SENTINEL_OK;
+    }
+    return SENTINEL_UNREACHABLE;
+}
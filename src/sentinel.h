@@ -8,11 +8,16 @@
 #ifndef SENTINEL_H_
 #define SENTINEL_H_
 #include "vector.h"
+#include "address.h"
 #include <hiredis/hiredis.h>
 
 #define DEFAULT_REDIS_PORT 6379
 #define DEFAULT_SENTINEL_PORT 26379
 
+/* Deadline (ms) for asking the sentinels when no connect timeout is configured */
+#define SENTINEL_PROBE_TIMEOUT 250
+#define SENTINEL_PROBE_MS(timeout) ((timeout) > 0 ? (timeout) : SENTINEL_PROBE_TIMEOUT)
+
 enum {
     SENTINEL_OK,
     SENTINEL_ERROR,
@@ -21,6 +26,14 @@ enum {
     SENTINEL_UNREACHABLE
 };
 
-int redisSentinelConnect(vector_t *sentinels, const char *service, redisContext **master_context);
+/* All sentinels are asked at once; the first master address reported by quorum sentinels wins.
+ * local_socket is the unix socket path used in place of TCP if the master is on this host; optional
+ * timeout (ms) bounds the wait for the sentinels and the connect to the master; 0 for SENTINEL_PROBE_TIMEOUT
+ * master is the last known master, tried first and confirmed with ROLE if host is set; updated on success. optional */
+int redisSentinelConnect(vector_t *sentinels, const char *service, const char *local_socket, long timeout, int quorum, address_t *master, redisContext **master_context);
+
+/* Append the addresses (address_t) of the replicas of service that sentinel considers healthy
+ * to replicas. The first sentinel to answer within timeout (ms; 0 for SENTINEL_PROBE_TIMEOUT) is used. */
+int redisSentinelReplicas(vector_t *sentinels, const char *service, long timeout, vector_t *replicas);
 
 #endif /* SENTINEL_H_ */
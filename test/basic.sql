@@ -1,3 +1,6 @@
+-- Checks fail with "CHECK constraint failed"; name and qty of basic_check are indexed:
+--   redis-cli sadd basic.main.basic_check.indices name qty
+--   sqlite3 -bail < basic.sql
 select load_extension('./libredis_vtbl.so');
 
 create virtual table basic_test using redis (localhost, basic, 
@@ -15,3 +18,77 @@ select c1 from basic_test where c1 > 0 and c0 = 'hello' and c2 > 3.1;
 delete from basic_test;
 drop table basic_test;
 
+
+create temp table expect (test text, ok integer check (ok));
+
+create virtual table basic_check using redis (localhost, basic,
+    name varchar,
+    qty int,
+    price float,
+    note text,
+    amount int,
+    data blob
+);
+delete from basic_check;
+
+-- qty '007' is stored as text; amount '1e0' is not an integer and reads as null
+insert into basic_check (name, qty, price, note, amount, data) values ('apple', 2, 1.5, 'b', '1e0', X'610062');
+insert into basic_check (name, qty, price, note, amount, data) values ('banana', 3, 2.5, 'B', 1, null);
+insert into basic_check (name, qty, price, note, amount, data) values ('cherry', 5, 0.5, 'a', 1, null);
+insert into basic_check (name, qty, price, note, amount, data) values ('Zebra', 4, 9.0, 'Z', 2, null);
+insert into basic_check (name, qty, price, note, amount, data) values ('date', '007', 3.5, 'c', 3, null);
+
+insert into expect values ('count', (select count(*) from basic_check) is 5);
+
+insert into expect values ('intersect', (select group_concat(name) from basic_check where name = 'banana' and qty = 3) is 'banana');
+insert into expect values ('intersect empty', (select count(*) from basic_check where name = 'banana' and qty = 2) is 0);
+insert into expect values ('intersect range', (select group_concat(name) from (select name from basic_check where qty > 2 and name < 'c' order by rowid)) is 'banana,Zebra');
+
+insert into expect values ('in int', (select group_concat(name) from (select name from basic_check where qty in (2, 5, 8) order by rowid)) is 'apple,cherry');
+insert into expect values ('in text', (select group_concat(name) from (select name from basic_check where name in ('apple', 'date', 'fig') order by rowid)) is 'apple,date');
+
+insert into expect values ('order asc', (select group_concat(name) from (select name from basic_check order by qty)) is 'apple,banana,Zebra,cherry,date');
+insert into expect values ('order desc', (select group_concat(name) from (select name from basic_check order by qty desc)) is 'date,cherry,Zebra,banana,apple');
+insert into expect values ('order text', (select group_concat(name) from (select name from basic_check order by name)) is 'Zebra,apple,banana,cherry,date');
+
+insert into expect values ('limit offset', (select group_concat(name) from (select name from basic_check where note >= 'a' order by rowid limit 2 offset 1)) is 'cherry,date');
+insert into expect values ('limit offset float', (select group_concat(name) from (select name from basic_check where price > 1 order by rowid limit 2 offset 1)) is 'banana,Zebra');
+
+-- text indexes and the filter compare bytewise: 'Z' < 'a'
+insert into expect values ('text gt', (select group_concat(name) from (select name from basic_check where name > 'banana' order by rowid)) is 'cherry,date');
+insert into expect values ('text range', (select group_concat(name) from basic_check where name >= 'Z' and name < 'a') is 'Zebra');
+insert into expect values ('text glob', (select group_concat(name) from basic_check where name glob 'ba*') is 'banana');
+insert into expect values ('filter bytewise', (select group_concat(name) from (select name from basic_check where note < 'a' order by rowid)) is 'banana,Zebra');
+
+-- '1e0' matches neither in the filter nor in sqlite, so LIMIT sees the same rows
+insert into expect values ('integer parse', (select count(*) from basic_check where amount = 1) is 2);
+insert into expect values ('integer parse limit', (select count(*) from (select 1 from basic_check where amount = 1 limit 2)) is 2);
+insert into expect values ('integer parse null', (select group_concat(name) from basic_check where amount is null) is 'apple');
+
+insert into expect values ('integer member', (select group_concat(name) from basic_check where qty = 7) is 'date');
+insert into expect values ('integer member range', (select group_concat(name) from basic_check where qty between 6 and 8) is 'date');
+insert into expect values ('integer member value', (select qty from basic_check where name = 'date') is 7);
+
+insert into expect values ('blob', (select hex(data) from basic_check where name = 'apple') is '610062');
+insert into expect values ('blob length', (select length(data) from basic_check where name = 'apple') is 3);
+
+update basic_check set qty = 9 where name = 'banana';
+insert into expect values ('update old', (select count(*) from basic_check where qty = 3) is 0);
+insert into expect values ('update new', (select group_concat(name) from basic_check where qty = 9) is 'banana');
+insert into expect values ('update unchanged', (select price || ',' || note from basic_check where name = 'banana') is '2.5,B');
+
+delete from basic_check where qty = 7;
+insert into expect values ('delete member', (select count(*) from basic_check where qty >= 6 and qty <= 8) is 0);
+insert into expect values ('delete order', (select name from basic_check order by qty desc limit 1) is 'banana');
+
+-- unconstrained delete truncates the table and its indexes
+delete from basic_check;
+insert into expect values ('truncate', (select count(*) from basic_check) is 0);
+insert into basic_check (name, qty, price, note, amount, data) values ('fig', 1, 1.0, 'f', 1, null);
+insert into expect values ('truncate insert', (select count(*) from basic_check) is 1);
+insert into expect values ('truncate index', (select group_concat(name) from basic_check where qty < 100) is 'fig');
+insert into expect values ('truncate text index', (select count(*) from basic_check where name = 'apple') is 0);
+
+delete from basic_check;
+drop table basic_check;
+drop table expect;
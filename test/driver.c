@@ -67,6 +67,8 @@ int perf_test(sqlite3 *db, int virt) {
     exec(db, "delete from perf");
     
     
+    /* one transaction; the writes reach redis as a single pipeline at commit */
+    exec(db, "begin");
     for(i = 0; i < 10000; ++i) {
         snprintf(buf, sizeof(buf), 
         "insert into perf "
@@ -74,10 +76,13 @@ int perf_test(sqlite3 *db, int virt) {
         "values (strftime('%%s','now'), %u)", i);
         if(quiet_exec(db, buf)) return 1;
     }
+    exec(db, "commit");
     
     exec(db, "select * from perf where idx = 50");
     exec(db, "select * from perf where idx < 50 limit 10");
     exec(db, "select * from perf where idx <= 50 limit 10");
+    exec(db, "select * from perf where idx < 50 order by rowid desc limit 10 offset 5");
+    exec(db, "select count(*) from perf");
     
     if(virt)
         exec(db, "select max(timestamp) - min(timestamp) as virt_duration from perf");
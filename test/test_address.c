@@ -92,6 +92,37 @@ int main() {
         assert(false);
     }
 
+    if(address_parse(&addr, "unix:/var/run/redis/redis.sock", 80) == ADDRESS_OK) {
+        printf("socket: %s\n", addr.host);
+        assert(address_unix_p(&addr));
+        assert(!strcmp(addr.host, "/var/run/redis/redis.sock"));
+        assert(address_local_p(&addr));
+        address_free(&addr);
+    } else {
+        assert(false);
+    }
+
+    if(address_parse(&addr, "unix:", 80) == ADDRESS_OK) {
+        assert(false);
+    } else {
+        printf("+expected fail\n");
+    }
+
+    if(address_parse(&addr, "127.0.0.1:6379", 80) == ADDRESS_OK) {
+        assert(!address_unix_p(&addr));
+        assert(address_local_p(&addr));
+        address_free(&addr);
+    } else {
+        assert(false);
+    }
+
+    if(address_parse(&addr, "192.0.2.1:6379", 80) == ADDRESS_OK) {     /* TEST-NET-1 */
+        assert(!address_local_p(&addr));
+        address_free(&addr);
+    } else {
+        assert(false);
+    }
+
     return 0;
 }
 
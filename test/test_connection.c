@@ -8,6 +8,10 @@
 int main() {
     int err;
     redis_vtbl_connection conn;
+    redis_vtbl_connection *shared0;
+    redis_vtbl_connection *shared1;
+    redis_vtbl_connection *shared2;
+    int owner0, owner1;
     
     err = redis_vtbl_connection_init(&conn, "127.0.0.1");
     if(err) {
@@ -21,6 +25,74 @@ int main() {
     }
     redis_vtbl_connection_free(&conn);
 
+    err = redis_vtbl_connection_init(&conn, "unix:/tmp/redis.sock");
+    if(err) {
+        return 1;
+    }
+    assert(conn.connect_timeout == CONNECTION_CONNECT_TIMEOUT);
+    redis_vtbl_connection_timeouts(&conn, -1, 250, 0);
+    assert(conn.connect_timeout == CONNECTION_CONNECT_TIMEOUT);
+    assert(conn.command_timeout == 250);
+    assert(conn.retry_deadline == 0);
+    redis_vtbl_connection_free(&conn);
+
+    err = redis_vtbl_connection_init(&conn, "sentinel db 127.0.0.1 unix:/tmp/redis.sock");
+    if(err) {
+        return 1;
+    }
+    assert(conn.addresses.size == 1);
+    assert(!strcmp(conn.local_socket, "/tmp/redis.sock"));
+    redis_vtbl_connection_free(&conn);
+
+    err = redis_vtbl_connection_init(&conn, "sentinel db unix:/tmp/redis.sock");
+    if(err != CONNECTION_BAD_FORMAT) return 1;
+
+    err = redis_vtbl_connection_init(&conn, "sentinel db quorum=2 127.0.0.1 192.168.1.1");
+    if(err) {
+        return 1;
+    }
+    assert(conn.quorum == 2);
+    assert(conn.addresses.size == 2);
+    assert(!conn.master.host[0]);
+    redis_vtbl_connection_free(&conn);
+
+    err = redis_vtbl_connection_init(&conn, "sentinel db quorum=0 127.0.0.1");
+    if(err != CONNECTION_BAD_FORMAT) return 1;
+
+    /* same owner & configuration share a connection */
+    err = redis_vtbl_connection_acquire(&shared0, "127.0.0.1", &owner0, -1, -1, -1);
+    if(err) return 1;
+    err = redis_vtbl_connection_acquire(&shared1, " 127.0.0.1 ", &owner0, -1, -1, -1);
+    if(err) return 1;
+    err = redis_vtbl_connection_acquire(&shared2, "127.0.0.1", &owner1, -1, -1, -1);
+    if(err) return 1;
+    assert(shared0 == shared1);
+    assert(shared0 != shared2);
+    redis_vtbl_connection_release(shared0);
+    redis_vtbl_connection_release(shared2);
+    err = redis_vtbl_connection_acquire(&shared2, "127.0.0.1", &owner0, -1, -1, -1);
+    if(err) return 1;
+    assert(shared1 == shared2);
+    redis_vtbl_connection_release(shared1);
+    redis_vtbl_connection_release(shared2);
+    
+    /* differing timeouts do not; explicit defaults do */
+    err = redis_vtbl_connection_acquire(&shared0, "127.0.0.1", &owner0, -1, -1, -1);
+    if(err) return 1;
+    err = redis_vtbl_connection_acquire(&shared1, "127.0.0.1", &owner0, -1, 250, -1);
+    if(err) return 1;
+    err = redis_vtbl_connection_acquire(&shared2, "127.0.0.1", &owner0, CONNECTION_CONNECT_TIMEOUT, -1, -1);
+    if(err) return 1;
+    assert(shared0 != shared1);
+    assert(shared0 == shared2);
+    assert(shared1->command_timeout == 250);
+    redis_vtbl_connection_release(shared0);
+    redis_vtbl_connection_release(shared1);
+    redis_vtbl_connection_release(shared2);
+    
+    err = redis_vtbl_connection_acquire(&shared0, "sentinel db", &owner0, -1, -1, -1);
+    if(err != CONNECTION_BAD_FORMAT) return 1;
+
     err = redis_vtbl_connection_init(&conn, "127.0.0.1");
     if(err) {
         return 1;